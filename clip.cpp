@@ -7,6 +7,10 @@
 #include "clip.h"
 #include "clip_lock_impl.h"
 
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <mutex>
 #include <vector>
 #include <stdexcept>
 
@@ -26,8 +30,55 @@ void default_error_handler(ErrorCode code) {
 
 error_handler g_error_handler = default_error_handler;
 
+static int g_lock_timeout = 100;
+static std::mutex g_lock_stats_mutex;
+static lock_stats g_lock_stats;
+
 lock::lock(void* native_window_handle)
-  : p(new impl(native_window_handle)) {
+  : lock(native_window_handle, g_lock_timeout) {
+}
+
+lock::lock(lock_mode mode)
+  : lock(nullptr, g_lock_timeout, mode) {
+}
+
+static void update_lock_stats(const std::chrono::steady_clock::time_point start,
+                              const bool locked,
+                              const bool contended) {
+  const size_t wait_usecs =
+    std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now() - start).count();
+
+  std::lock_guard<std::mutex> lock(g_lock_stats_mutex);
+  if (locked)
+    ++g_lock_stats.locks;
+  else
+    ++g_lock_stats.timeouts;
+  if (contended)
+    ++g_lock_stats.contended;
+  g_lock_stats.total_wait_usecs += wait_usecs;
+  g_lock_stats.max_wait_usecs = std::max(g_lock_stats.max_wait_usecs, wait_usecs);
+}
+
+lock::lock(void* native_window_handle, int timeout_msecs, lock_mode mode) {
+  const auto start = std::chrono::steady_clock::now();
+  p.reset(new impl(native_window_handle, timeout_msecs, mode));
+  update_lock_stats(start, p->locked(), p->contended());
+}
+
+lock::lock(context& ctx, lock_mode mode)
+  : lock(ctx, g_lock_timeout, mode) {
+}
+
+lock::lock(context& ctx, int timeout_msecs, lock_mode mode) {
+  const auto start = std::chrono::steady_clock::now();
+#ifdef HAVE_XCB_XLIB_H
+  p.reset(new impl(ctx.p.get(), timeout_msecs, mode));
+#else
+  // There is just one clipboard on these platforms.
+  p.reset(new impl(nullptr, timeout_msecs, mode));
+#endif
+  update_lock_stats(start, p->locked(), p->contended());
 }
 
 lock::~lock() = default;
@@ -36,7 +87,15 @@ bool lock::locked() const {
   return p->locked();
 }
 
+void lock::set_x11_read_timeout(int msecs) {
+#ifdef HAVE_XCB_XLIB_H
+  p->set_x11_read_timeout(msecs);
+#endif
+}
+
 bool lock::clear() {
+  if (p->shared())
+    return false;
   return p->clear();
 }
 
@@ -45,6 +104,8 @@ bool lock::is_convertible(format f) const {
 }
 
 bool lock::set_data(format f, const char* buf, size_t length) {
+  if (p->shared())
+    return false;
   return p->set_data(f, buf, length);
 }
 
@@ -56,9 +117,36 @@ size_t lock::get_data_length(format f) const {
   return p->get_data_length(f);
 }
 
+bool lock::get_data_stream(format f, const data_stream_callback& callback) const {
+  return p->get_data_stream(f, callback);
+}
+
+bool lock::get_many(const std::vector<format>& formats,
+                    std::vector<std::vector<char>>& data) const {
+#ifdef HAVE_XCB_XLIB_H
+  return p->get_many(formats, data);
+#else
+  bool result = true;
+  data.assign(formats.size(), std::vector<char>());
+  for (size_t i=0; i<formats.size(); ++i) {
+    std::vector<char>& buf = data[i];
+    if (!p->get_data_stream(formats[i],
+                            [&buf](const char* chunk, size_t len) {
+                              buf.insert(buf.end(), chunk, chunk+len);
+                            })) {
+      buf.clear();
+      result = false;
+    }
+  }
+  return result;
+#endif
+}
+
 #if CLIP_ENABLE_IMAGE
 
 bool lock::set_image(const image& img) {
+  if (p->shared())
+    return false;
   return p->set_image(img);
 }
 
@@ -86,24 +174,24 @@ format text_format()  { return 1; }
 format image_format() { return 2; }
 #endif
 
-bool has(format f) {
-  lock l;
+bool context::has(format f) {
+  lock l(*this, lock_mode::shared);
   if (l.locked())
     return l.is_convertible(f);
   else
     return false;
 }
 
-bool clear() {
-  lock l;
+bool context::clear() {
+  lock l(*this);
   if (l.locked())
     return l.clear();
   else
     return false;
 }
 
-bool set_text(const std::string& value) {
-  lock l;
+bool context::set_text(const std::string& value) {
+  lock l(*this);
   if (l.locked()) {
     l.clear();
     return l.set_data(text_format(), value.c_str(), value.size());
@@ -112,8 +200,8 @@ bool set_text(const std::string& value) {
     return false;
 }
 
-bool get_text(std::string& value) {
-  lock l;
+bool context::get_text(std::string& value) {
+  lock l(*this, lock_mode::shared);
   if (!l.locked())
     return false;
 
@@ -121,23 +209,28 @@ bool get_text(std::string& value) {
   if (!l.is_convertible(f))
     return false;
 
-  size_t len = l.get_data_length(f);
-  if (len > 0) {
-    std::vector<char> buf(len);
-    l.get_data(f, &buf[0], len);
-    value = &buf[0];
-    return true;
-  }
-  else {
+  // Receive the data directly in the string, in this way we don't
+  // need to ask for the length of the data first (which can require
+  // an extra request to the clipboard owner) or copy it from other
+  // buffer.
+  value.clear();
+  if (!l.get_data_stream(f,
+                         [&value](const char* buf, size_t len) {
+                           value.append(buf, len);
+                         })) {
     value.clear();
-    return true;
+    return false;
   }
+
+  // Trim the text to the first null character
+  value.resize(std::strlen(value.c_str()));
+  return true;
 }
 
 #if CLIP_ENABLE_IMAGE
 
-bool set_image(const image& img) {
-  lock l;
+bool context::set_image(const image& img) {
+  lock l(*this);
   if (l.locked()) {
     l.clear();
     return l.set_image(img);
@@ -146,8 +239,8 @@ bool set_image(const image& img) {
     return false;
 }
 
-bool get_image(image& img) {
-  lock l;
+bool context::get_image(image& img) {
+  lock l(*this, lock_mode::shared);
   if (!l.locked())
     return false;
 
@@ -158,8 +251,8 @@ bool get_image(image& img) {
   return l.get_image(img);
 }
 
-bool get_image_spec(image_spec& spec) {
-  lock l;
+bool context::get_image_spec(image_spec& spec) {
+  lock l(*this, lock_mode::shared);
   if (!l.locked())
     return false;
 
@@ -172,6 +265,115 @@ bool get_image_spec(image_spec& spec) {
 
 #endif // CLIP_ENABLE_IMAGE
 
+bool context::get_data_if_changed(format f,
+                                  size_t& last_change_count,
+                                  std::vector<char>& data) {
+  const size_t count = change_count();
+  if (count == last_change_count)
+    return false;
+
+  lock l(*this, lock_mode::shared);
+  if (!l.locked())
+    return false;
+
+  // If the content changes after change_count() we get the new
+  // content, and we'll get it again in the next call (which is
+  // better than missing a change).
+  last_change_count = count;
+
+  data.clear();
+  if (!l.is_convertible(f))
+    return false;
+
+  return l.get_data_stream(f,
+                           [&data](const char* buf, size_t len) {
+                             data.insert(data.end(), buf, buf+len);
+                           });
+}
+
+static context& default_context() {
+  static context ctx;
+  return ctx;
+}
+
+std::vector<format> register_formats(const std::vector<std::string>& names) {
+  return default_context().register_formats(names);
+}
+
+bool has(format f) {
+  return default_context().has(f);
+}
+
+bool get_data_if_changed(format f,
+                         size_t& last_change_count,
+                         std::vector<char>& data) {
+  return default_context().get_data_if_changed(f, last_change_count, data);
+}
+
+bool clear() {
+  return default_context().clear();
+}
+
+bool set_text(const std::string& value) {
+  return default_context().set_text(value);
+}
+
+bool get_text(std::string& value) {
+  return default_context().get_text(value);
+}
+
+#if CLIP_ENABLE_IMAGE
+
+bool set_image(const image& img) {
+  return default_context().set_image(img);
+}
+
+bool get_image(image& img) {
+  return default_context().get_image(img);
+}
+
+bool get_image_spec(image_spec& spec) {
+  return default_context().get_image_spec(spec);
+}
+
+#endif // CLIP_ENABLE_IMAGE
+
+void get_text_async(const text_callback& callback,
+                    const cancel_token& token) {
+  default_context().get_text_async(callback, token);
+}
+
+void get_data_async(format f,
+                    const data_callback& callback,
+                    const cancel_token& token) {
+  default_context().get_data_async(f, callback, token);
+}
+
+#if CLIP_ENABLE_IMAGE
+
+void get_image_async(const image_callback& callback,
+                     const cancel_token& token) {
+  default_context().get_image_async(callback, token);
+}
+
+#endif // CLIP_ENABLE_IMAGE
+
+watch_id watch(const watch_callback& callback) {
+  return default_context().watch(callback);
+}
+
+void unwatch(watch_id id) {
+  default_context().unwatch(id);
+}
+
+void persist(const persist_callback& callback) {
+  default_context().persist(callback);
+}
+
+int dispatch_pending() {
+  return default_context().dispatch_pending();
+}
+
 void set_error_handler(error_handler handler) {
   g_error_handler = handler;
 }
@@ -180,13 +382,168 @@ error_handler get_error_handler() {
   return g_error_handler;
 }
 
+void set_lock_timeout(int msecs) {
+  g_lock_timeout = msecs;
+}
+
+int get_lock_timeout() {
+  return g_lock_timeout;
+}
+
+lock_stats get_lock_stats() {
+  std::lock_guard<std::mutex> lock(g_lock_stats_mutex);
+  return g_lock_stats;
+}
+
+#ifndef HAVE_XCB_XLIB_H
+
+// There is just one clipboard on these platforms, so all contexts use
+// it.
+class context::impl { };
+
+context::context(const std::string&)
+  : p(new impl) {
+}
+
+context::~context() = default;
+
+format context::register_format(const std::string& name) {
+  return clip::register_format(name);
+}
+
+std::vector<format> context::register_formats(const std::vector<std::string>& names) {
+  std::vector<format> result;
+  for (const auto& name : names)
+    result.push_back(register_format(name));
+  return result;
+}
+
+size_t context::change_count() {
+  return clip::change_count();
+}
+
+// On these platforms the clipboard content is available immediately,
+// so the asynchronous functions just call the callback with the
+// result of the synchronous API.
+
+void context::get_text_async(const text_callback& callback,
+                             const cancel_token& token) {
+  std::string value;
+  const bool ok = (!token.is_cancelled() && get_text(value));
+  callback(ok, std::move(value));
+}
+
+void context::get_data_async(format f,
+                             const data_callback& callback,
+                             const cancel_token& token) {
+  std::vector<char> data;
+  bool ok = false;
+  if (!token.is_cancelled()) {
+    lock l(*this);
+    if (l.locked() && l.is_convertible(f)) {
+      ok = l.get_data_stream(f,
+                             [&data](const char* buf, size_t len) {
+                               data.insert(data.end(), buf, buf+len);
+                             });
+    }
+  }
+  callback(ok, std::move(data));
+}
+
+#if CLIP_ENABLE_IMAGE
+
+void context::get_image_async(const image_callback& callback,
+                              const cancel_token& token) {
+  image img;
+  const bool ok = (!token.is_cancelled() && get_image(img));
+  callback(ok, std::move(img));
+}
+
+#endif // CLIP_ENABLE_IMAGE
+
+watch_id context::watch(const watch_callback&) {
+  return 0;
+}
+
+void context::unwatch(watch_id) {
+}
+
+// The clipboard content is kept by the system when the process exits.
+void context::persist(const persist_callback& callback) {
+  if (callback)
+    callback(true);
+}
+
+int context::dispatch_pending() {
+  return -1;
+}
+
+void cancel_token::cancel() {
+  *m_cancelled = true;
+}
+
+#endif // !HAVE_XCB_XLIB_H
+
 #ifdef HAVE_XCB_XLIB_H
 static int g_x11_timeout = 1000;
 void set_x11_wait_timeout(int msecs) { g_x11_timeout = msecs; }
 int get_x11_wait_timeout() { return g_x11_timeout; }
+
+static int g_x11_transfer_timeout = 0;
+void set_x11_transfer_timeout(int msecs) { g_x11_transfer_timeout = msecs; }
+int get_x11_transfer_timeout() { return g_x11_transfer_timeout; }
+
+static bool g_x11_adaptive_timeout = false;
+void set_x11_adaptive_timeout(bool state) { g_x11_adaptive_timeout = state; }
+bool get_x11_adaptive_timeout() { return g_x11_adaptive_timeout; }
+
+static int g_x11_persist_timeout = 1000;
+void set_x11_persist_timeout(int msecs) { g_x11_persist_timeout = msecs; }
+int get_x11_persist_timeout() { return g_x11_persist_timeout; }
+
+static bool g_x11_auto_persist = false;
+void set_x11_auto_persist(bool state) { g_x11_auto_persist = state; }
+bool get_x11_auto_persist() { return g_x11_auto_persist; }
+
+static bool g_x11_threadless = false;
+void set_x11_threadless(bool state) { g_x11_threadless = state; }
+bool get_x11_threadless() { return g_x11_threadless; }
+
+// The prefetch policy is read from the X11 background thread.
+static std::mutex g_x11_prefetch_mutex;
+static x11_prefetch_policy g_x11_prefetch_policy;
+void set_x11_prefetch_policy(const x11_prefetch_policy& policy) {
+  std::lock_guard<std::mutex> lock(g_x11_prefetch_mutex);
+  g_x11_prefetch_policy = policy;
+}
+x11_prefetch_policy get_x11_prefetch_policy() {
+  std::lock_guard<std::mutex> lock(g_x11_prefetch_mutex);
+  return g_x11_prefetch_policy;
+}
 #else
 void set_x11_wait_timeout(int) { }
 int get_x11_wait_timeout() { return 1000; }
+void set_x11_transfer_timeout(int) { }
+int get_x11_transfer_timeout() { return 0; }
+void set_x11_adaptive_timeout(bool) { }
+bool get_x11_adaptive_timeout() { return false; }
+void set_x11_persist_timeout(int) { }
+int get_x11_persist_timeout() { return 1000; }
+void set_x11_auto_persist(bool) { }
+bool get_x11_auto_persist() { return false; }
+void set_x11_threadless(bool) { }
+bool get_x11_threadless() { return false; }
+int get_x11_fd() { return -1; }
+namespace x11 {
+bool set_connection(xcb_connection_t*, unsigned long) { return false; }
+bool handle_event(const void*) { return false; }
+}
+x11_stats get_x11_stats() { return x11_stats(); }
+// There is nothing expensive to initialize on these platforms.
+void initialize_async() { }
+size_t wait_initialization() { return 0; }
+void set_x11_prefetch_policy(const x11_prefetch_policy&) { }
+x11_prefetch_policy get_x11_prefetch_policy() { return x11_prefetch_policy(); }
 #endif
 
 } // namespace clip
@@ -8,11 +8,16 @@
 #define CLIP_H_INCLUDED
 #pragma once
 
+#include <atomic>
 #include <cassert>
+#include <functional>
 #include <memory>
 #include <string>
 #include <vector>
 
+// Opaque type of the xcb library (see clip::x11::set_connection()).
+struct xcb_connection_t;
+
 namespace clip {
 
   // ======================================================================
@@ -39,6 +44,21 @@ namespace clip {
   };
 #endif // CLIP_ENABLE_LIST_FORMATS
 
+  // Several threads can lock the clipboard in shared mode at the
+  // same time to read its content (in this mode clear(), set_data()
+  // and set_image() fail). On X11 readers run in parallel, on other
+  // platforms a shared lock is the same as an exclusive lock.
+  enum class lock_mode {
+    exclusive,
+    shared,
+  };
+
+  class context;
+
+  // Function called with each chunk of data received by
+  // lock::get_data_stream().
+  typedef std::function<void(const char* buf, size_t len)> data_stream_callback;
+
   class lock {
   public:
     // You can give your current HWND as the "native_window_handle."
@@ -48,12 +68,36 @@ namespace clip {
     // EmptyClipboard() call. Anyway it looks to work just fine if we
     // call OpenClipboard() with a null HWND.
     lock(void* native_window_handle = nullptr);
+
+    // Locks the clipboard in the given mode (e.g. lock_mode::shared
+    // to read the clipboard from several threads at the same time).
+    explicit lock(lock_mode mode);
+
+    // Waits at most "timeout_msecs" milliseconds to lock the
+    // clipboard (the default constructor waits get_lock_timeout()).
+    lock(void* native_window_handle,
+         int timeout_msecs,
+         lock_mode mode = lock_mode::exclusive);
+
+    // Locks the clipboard of the given context (see clip::context).
+    explicit lock(context& ctx,
+                  lock_mode mode = lock_mode::exclusive);
+    lock(context& ctx,
+         int timeout_msecs,
+         lock_mode mode = lock_mode::exclusive);
     ~lock();
 
     // Returns true if we've locked the clipboard successfully in
     // lock() constructor.
     bool locked() const;
 
+    // Only for X11: Limits the time (in milliseconds from now) that
+    // the read functions of this lock can wait for the clipboard
+    // owner as a whole (e.g. get_data() of big content received in
+    // several chunks). When the time is over they fail. See
+    // set_x11_transfer_timeout() for a limit of each read.
+    void set_x11_read_timeout(int msecs);
+
     // Clears the clipboard content. If you don't clear the content,
     // previous clipboard content (in unknown formats) could persist
     // after the unlock.
@@ -64,8 +108,31 @@ namespace clip {
     bool is_convertible(format f) const;
     bool set_data(format f, const char* buf, size_t len);
     bool get_data(format f, char* buf, size_t len) const;
+
+    // Returns the size of the clipboard data in the given format. On
+    // X11 the data is not transferred to know its size, but for big
+    // data (sent with the INCR method) the owner can report a lower
+    // bound of the real size.
     size_t get_data_length(format f) const;
 
+    // Calls the given callback with each chunk of the clipboard data
+    // as soon as it's received, so the whole content doesn't need to
+    // be kept in memory. The text format is given without the extra
+    // null character at the end. The function returns after the last
+    // chunk, but on X11 the callback can be called from the
+    // background thread that receives the data (while this thread
+    // waits), so it must not block or use the clipboard.
+    bool get_data_stream(format f, const data_stream_callback& callback) const;
+
+    // Gets the clipboard data in several formats at once. "data" will
+    // contain the data of each format as returned by
+    // get_data_stream() (empty if the format is not available).
+    // Returns true if all formats were received. On X11 the formats
+    // are requested to the clipboard owner in one round trip (using
+    // the MULTIPLE target).
+    bool get_many(const std::vector<format>& formats,
+                  std::vector<std::vector<char>>& data) const;
+
 #if CLIP_ENABLE_IMAGE
     // For images
     bool set_image(const image& image);
@@ -86,6 +153,11 @@ namespace clip {
 
   format register_format(const std::string& name);
 
+  // Registers several formats at once (on X11 in just one round trip
+  // to the X server). Registering the same name twice returns the
+  // same format.
+  std::vector<format> register_formats(const std::vector<std::string>& names);
+
   // This format is when the clipboard has no content.
   format empty_format();
 
@@ -100,9 +172,84 @@ namespace clip {
   // Returns true if the clipboard has content of the given type.
   bool has(format f);
 
+  // Returns a number that changes each time the clipboard content
+  // changes (like NSPasteboard changeCount on macOS, or
+  // GetClipboardSequenceNumber() on Windows). On X11 it's updated
+  // with XFixes events, without XFixes we cannot know if the content
+  // has changed, so each call returns a new number.
+  size_t change_count();
+
+  // Gets the clipboard data in the given format (as returned by
+  // lock::get_data_stream()) only if the clipboard has changed since
+  // "last_change_count" was returned by change_count(). If nothing
+  // has changed, returns false immediately without locking the
+  // clipboard. In other case "last_change_count" is updated (even if
+  // there is no data in the given format). Use 0 as the initial
+  // "last_change_count" to get the current content.
+  bool get_data_if_changed(format f,
+                           size_t& last_change_count,
+                           std::vector<char>& data);
+
   // Clears the clipboard content.
   bool clear();
 
+  // ======================================================================
+  // Lock timeout and statistics
+  // ======================================================================
+
+  // Sets the time (in milliseconds) that lock() waits to lock the
+  // clipboard before failing with ErrorCode::CannotLock. This value is
+  // 100 by default.
+  void set_lock_timeout(int msecs);
+  int get_lock_timeout();
+
+  struct lock_stats {
+    size_t locks = 0;     // Number of times the clipboard was locked
+    size_t contended = 0; // Number of locks that had to wait for other thread/process
+    size_t timeouts = 0;  // Number of locks that failed
+    size_t total_wait_usecs = 0; // Total time waiting to lock the clipboard
+    size_t max_wait_usecs = 0;   // Maximum time waiting to lock the clipboard
+  };
+
+  // Returns statistics about the clipboard locks of this process (the
+  // first lock includes the time to initialize the clipboard).
+  lock_stats get_lock_stats();
+
+  // ======================================================================
+  // Initialization
+  // ======================================================================
+
+  // Initializes the clipboard in a background thread (on X11 it
+  // connects to the X server, creates the clipboard window, and
+  // interns all the atoms), so the first lock doesn't have to wait
+  // for it. Calling it is optional, and does nothing if the
+  // clipboard is already initialized.
+  void initialize_async();
+
+  // Waits the initialization started with initialize_async(). Returns
+  // the time (in microseconds) that the initialization took, or 0 if
+  // it wasn't started.
+  size_t wait_initialization();
+
+  // ======================================================================
+  // Persistence
+  // ======================================================================
+
+  // Function called with the result of persist().
+  typedef std::function<void(bool ok)> persist_callback;
+
+  // Asks the system to keep the clipboard content that we own after
+  // this process exits, without waiting for it. On X11 the content is
+  // given to the clipboard manager (SAVE_TARGETS), and the callback
+  // is called from the background thread with true when the content
+  // was saved, or false if we don't own the clipboard, there is no
+  // clipboard manager, or it didn't answer in
+  // get_x11_persist_timeout() milliseconds. If the content was
+  // already saved, the process can exit without waiting the
+  // clipboard manager again. On other platforms the content is kept
+  // anyway and the callback is called immediately with true.
+  void persist(const persist_callback& callback = persist_callback());
+
   // ======================================================================
   // Error handling
   // ======================================================================
@@ -196,6 +343,145 @@ namespace clip {
 
 #endif // CLIP_ENABLE_IMAGE
 
+  // ======================================================================
+  // Asynchronous API
+  // ======================================================================
+
+  // Used to cancel an asynchronous request. Copies of the same token
+  // share the cancellation state.
+  class cancel_token {
+  public:
+    cancel_token() : m_cancelled(std::make_shared<std::atomic<bool>>(false)) { }
+
+    // The requests that use this token fail as soon as possible (on
+    // X11 the background thread is woken up to finish them).
+    void cancel();
+    bool is_cancelled() const { return *m_cancelled; }
+
+  private:
+    std::shared_ptr<std::atomic<bool>> m_cancelled;
+  };
+
+  typedef std::function<void(bool ok, std::string value)> text_callback;
+  typedef std::function<void(bool ok, std::vector<char> data)> data_callback;
+
+  // Gets the clipboard content without blocking the caller. The
+  // callback is called with ok=false if the content cannot be
+  // received or the request is cancelled with the given token. On X11
+  // the callback is called from the background thread used to
+  // process X11 events (so it must not block, and the synchronous
+  // functions called from it fail instead of waiting, see watch()),
+  // on other platforms the content is received immediately and the
+  // callback is called before the function returns.
+  void get_text_async(const text_callback& callback,
+                      const cancel_token& token = cancel_token());
+  void get_data_async(format f,
+                      const data_callback& callback,
+                      const cancel_token& token = cancel_token());
+
+#if CLIP_ENABLE_IMAGE
+  typedef std::function<void(bool ok, image img)> image_callback;
+
+  void get_image_async(const image_callback& callback,
+                       const cancel_token& token = cancel_token());
+#endif // CLIP_ENABLE_IMAGE
+
+  // ======================================================================
+  // Change notifications
+  // ======================================================================
+
+  struct clipboard_change {
+    // Native handle of the new clipboard owner (on X11 the owner
+    // window), or 0 if the clipboard has no owner.
+    unsigned long owner = 0;
+
+    // Server time of the change (on X11 the selection timestamp).
+    unsigned long timestamp = 0;
+  };
+
+  typedef std::function<void(const clipboard_change& change)> watch_callback;
+  typedef size_t watch_id;
+
+  // Calls the given callback each time the clipboard owner changes
+  // (i.e. when there is new content in the clipboard). The callback is
+  // called from a background thread. Returns 0 if it's not supported
+  // (only X11 with the XFixes extension is supported at the moment).
+  //
+  // On X11 the callback is called from the thread that processes the
+  // X11 events, so it cannot wait for other threads or clipboard
+  // owners: the synchronous functions (e.g. get_text()) fail
+  // immediately if the clipboard is locked by other thread or the
+  // content must be received from other process. Use the
+  // asynchronous functions (e.g. get_text_async()) instead.
+  watch_id watch(const watch_callback& callback);
+
+  // Stops calling the callback registered with watch(). The callback
+  // can still be called once if a notification is in progress.
+  void unwatch(watch_id id);
+
+  // ======================================================================
+  // Clipboard contexts
+  // ======================================================================
+
+  // The clipboard of a specific display. On X11 each context has its
+  // own connection to the given display (e.g. ":1") and its own event
+  // thread, so one process can use the clipboards of several displays
+  // in parallel. An empty display is the default context, the one
+  // used by the free functions (clip::get_text(), clip::lock(),
+  // etc.). Each member function works like the free function with
+  // the same name. Formats registered in one context are not valid
+  // in other contexts. On other platforms there is just one
+  // clipboard and the display is ignored.
+  class context {
+  public:
+    explicit context(const std::string& display = std::string());
+    ~context();
+
+    context(const context&) = delete;
+    context& operator=(const context&) = delete;
+
+    format register_format(const std::string& name);
+    std::vector<format> register_formats(const std::vector<std::string>& names);
+    bool has(format f);
+    size_t change_count();
+    bool get_data_if_changed(format f,
+                             size_t& last_change_count,
+                             std::vector<char>& data);
+    bool clear();
+    bool set_text(const std::string& value);
+    bool get_text(std::string& value);
+
+#if CLIP_ENABLE_IMAGE
+    bool set_image(const image& img);
+    bool get_image(image& img);
+    bool get_image_spec(image_spec& spec);
+#endif // CLIP_ENABLE_IMAGE
+
+    void get_text_async(const text_callback& callback,
+                        const cancel_token& token = cancel_token());
+    void get_data_async(format f,
+                        const data_callback& callback,
+                        const cancel_token& token = cancel_token());
+#if CLIP_ENABLE_IMAGE
+    void get_image_async(const image_callback& callback,
+                         const cancel_token& token = cancel_token());
+#endif // CLIP_ENABLE_IMAGE
+
+    watch_id watch(const watch_callback& callback);
+    void unwatch(watch_id id);
+    void persist(const persist_callback& callback = persist_callback());
+
+    // Only for X11: Processes the pending events of the context in
+    // threadless mode (only the default context can be threadless,
+    // see dispatch_pending()).
+    int dispatch_pending();
+
+  private:
+    friend class lock;
+    class impl;
+    std::unique_ptr<impl> p;
+  };
+
   // ======================================================================
   // Platform-specific
   // ======================================================================
@@ -206,6 +492,126 @@ namespace clip {
   void set_x11_wait_timeout(int msecs);
   int get_x11_wait_timeout();
 
+  // Only for X11: Sets the maximum time (in milliseconds) that each
+  // read operation can take as a whole (asking for each target and
+  // receiving all the chunks of big data). It's 0 by default, which
+  // means that there is no limit for the whole operation (only the
+  // wait timeout for each answer of the selection owner).
+  void set_x11_transfer_timeout(int msecs);
+  int get_x11_transfer_timeout();
+
+  // Only for X11: If it's enabled, the time to wait for each answer
+  // of a selection owner is calculated from the latency of its
+  // previous answers (and it's never bigger than
+  // get_x11_wait_timeout()), so an owner that usually answers quickly
+  // fails quickly too. It's disabled by default.
+  void set_x11_adaptive_timeout(bool state);
+  bool get_x11_adaptive_timeout();
+
+  // Only for X11: Sets the maximum time (in milliseconds) that the
+  // clipboard manager has to save our content (see persist()). It's
+  // used when the process exits too. This value is 1000 (one second)
+  // by default.
+  void set_x11_persist_timeout(int msecs);
+  int get_x11_persist_timeout();
+
+  // Only for X11: If it's enabled, persist() is called each time that
+  // we take the clipboard ownership (when a lock that modified the
+  // content is released), so the clipboard manager receives the
+  // content as soon as possible and the process can exit without
+  // waiting for it. It's disabled by default.
+  void set_x11_auto_persist(bool state);
+  bool get_x11_auto_persist();
+
+  // Only for X11: If it's enabled before the clipboard is used for
+  // the first time, the X11 events are not processed in a background
+  // thread. In this mode the events are processed in the thread that
+  // waits for the clipboard content, or in dispatch_pending() (where
+  // the callbacks of watch() and the asynchronous functions are
+  // called). It's disabled by default.
+  void set_x11_threadless(bool state);
+  bool get_x11_threadless();
+
+  // Only for X11: Returns the file descriptor of the X11 connection
+  // used by the clipboard, so you can wait for its events in your own
+  // event loop (e.g. with epoll), or -1 if it's not available.
+  int get_x11_fd();
+
+  // Processes the pending clipboard events without blocking. It's
+  // needed only in the X11 threadless mode, and it must be called
+  // each time get_x11_fd() is readable. Returns the maximum time (in
+  // milliseconds) to wait before calling it again (e.g. to check the
+  // timeouts of the requests in progress), or -1 if it's not needed.
+  // The events that xcb reads while the clipboard functions wait for
+  // a reply don't make get_x11_fd() readable, so these functions
+  // process them before they return, and dispatch_pending() returns
+  // 0 if there are events of this kind that it couldn't process.
+  int dispatch_pending();
+
+  namespace x11 {
+
+    // Uses the given xcb connection of your application (and the
+    // given window to own the clipboard) instead of opening a new
+    // connection. It must be called before the clipboard is used for
+    // the first time. In this mode the clipboard doesn't read the
+    // events of the connection, so you have to give them to
+    // handle_event(), and then events are processed as in the
+    // threadless mode (see set_x11_threadless()). Don't wait for the
+    // clipboard content in the thread that reads the events (use the
+    // asynchronous functions there instead). In this mode we cannot
+    // know if a refused conversion was for us or for your
+    // application, so a format that the owner doesn't support fails
+    // after get_x11_wait_timeout() instead of immediately. Returns
+    // false if the clipboard was already used (with its own
+    // connection), or if it's not X11.
+    bool set_connection(xcb_connection_t* connection, unsigned long window);
+
+    // Gives to the clipboard an event (a xcb_generic_event_t*)
+    // received in the connection specified in set_connection().
+    // Returns true if the event was for the clipboard only.
+    bool handle_event(const void* xcb_event);
+
+  } // namespace x11
+
+  // Only for X11: Statistics about the data transfers from other
+  // clipboard owners.
+  struct x11_stats {
+    // Number of requests answered with data already received in the
+    // same lock (e.g. get_data_length() + get_data()), and number of
+    // requests that needed a new transfer.
+    size_t cache_hits = 0;
+    size_t cache_misses = 0;
+
+    // Number of transfers received in the background with the
+    // x11_prefetch_policy.
+    size_t prefetches = 0;
+
+    // Number of reads that got the data from the same transfer (or
+    // the same decoded image) of other thread reading at the same
+    // time.
+    size_t coalesced = 0;
+
+    // Number of times that the X server refused to give us the
+    // clipboard ownership when a lock with new content was released.
+    size_t ownership_errors = 0;
+  };
+
+  x11_stats get_x11_stats();
+
+  // Only for X11 (with XFixes): When other application takes the
+  // clipboard ownership, we can ask for its content in the
+  // background, so a later get_text()/get_data() is served from
+  // memory. Only the given "formats" with a size less than or equal
+  // to "max_size" are received. Prefetching is disabled by default
+  // (empty "formats").
+  struct x11_prefetch_policy {
+    std::vector<format> formats;
+    size_t max_size = 64*1024;
+  };
+
+  void set_x11_prefetch_policy(const x11_prefetch_policy& policy);
+  x11_prefetch_policy get_x11_prefetch_policy();
+
 } // namespace clip
 
 #endif // CLIP_H_INCLUDED
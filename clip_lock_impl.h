@@ -11,15 +11,26 @@ namespace clip {
 
 class lock::impl {
 public:
-  impl(void* native_window_handle);
+  impl(void* native_window_handle, int timeout_msecs, lock_mode mode);
+#ifdef HAVE_XCB_XLIB_H
+  impl(context::impl* ctx, int timeout_msecs, lock_mode mode);
+#endif
   ~impl();
 
   bool locked() const { return m_locked; }
+  bool contended() const { return m_contended; }
+  bool shared() const { return m_shared; }
   bool clear();
   bool is_convertible(format f) const;
   bool set_data(format f, const char* buf, size_t len);
   bool get_data(format f, char* buf, size_t len) const;
   size_t get_data_length(format f) const;
+  bool get_data_stream(format f, const data_stream_callback& callback) const;
+#ifdef HAVE_XCB_XLIB_H
+  bool get_many(const std::vector<format>& formats,
+                std::vector<std::vector<char>>& data) const;
+  void set_x11_read_timeout(int msecs);
+#endif
 
 #if CLIP_ENABLE_IMAGE
   bool set_image(const image& image);
@@ -33,6 +44,19 @@ public:
 
 private:
   bool m_locked;
+
+  // True if we had to wait for other thread/process to lock the
+  // clipboard.
+  bool m_contended = false;
+
+  // True if the clipboard was locked in lock_mode::shared (the
+  // content cannot be modified).
+  bool m_shared;
+
+#ifdef HAVE_XCB_XLIB_H
+  // Locked context (see clip::context).
+  context::impl* m_context;
+#endif
 };
 
 } // namespace clip
@@ -17,9 +17,13 @@ typedef std::vector<char> Buffer;
 typedef std::map<format, Buffer> Map;
 
 static format g_last_format = 100; // TODO create an enum with common formats
+static std::map<std::string, format> g_name_to_format;
 static Map g_data;
+static size_t g_change_count = 1;
 
-lock::impl::impl(void* native_handle) : m_locked(true) {
+lock::impl::impl(void* native_handle, int, lock_mode mode)
+  : m_locked(true)
+  , m_shared(mode == lock_mode::shared) {
 }
 
 lock::impl::~impl() {
@@ -27,6 +31,7 @@ lock::impl::~impl() {
 
 bool lock::impl::clear() {
   g_data.clear();
+  ++g_change_count;
   return true;
 }
 
@@ -36,6 +41,7 @@ bool lock::impl::is_convertible(format f) const {
 
 bool lock::impl::set_data(format f, const char* buf, size_t len) {
   Buffer& dst = g_data[f];
+  ++g_change_count;
 
   dst.resize(len);
   if (buf && len > 0)
@@ -67,6 +73,20 @@ size_t lock::impl::get_data_length(format f) const {
     return 0;
 }
 
+bool lock::impl::get_data_stream(format f, const data_stream_callback& callback) const {
+  if (!is_convertible(f))
+    return false;
+
+  const Buffer& src = g_data[f];
+  size_t len = src.size();
+  if (f == text_format() && len > 0 && src.back() == 0)
+    --len;
+
+  if (len > 0)
+    callback(&src[0], len);
+  return true;
+}
+
 #if CLIP_ENABLE_IMAGE
 
 bool lock::impl::set_image(const image& image) {
@@ -84,7 +104,18 @@ bool lock::impl::get_image_spec(image_spec& spec) const {
 #endif // CLIP_ENABLE_IMAGE
 
 format register_format(const std::string& name) {
-  return g_last_format++;
+  // Check if the format is already registered
+  auto it = g_name_to_format.find(name);
+  if (it != g_name_to_format.end())
+    return it->second;
+
+  format new_format = g_last_format++;
+  g_name_to_format[name] = new_format;
+  return new_format;
+}
+
+size_t change_count() {
+  return g_change_count;
 }
 
 } // namespace clip
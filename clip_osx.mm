@@ -143,7 +143,9 @@ namespace osx {
 
 } // namespace osx
 
-lock::impl::impl(void*) : m_locked(true) {
+lock::impl::impl(void*, int, lock_mode mode)
+  : m_locked(true)
+  , m_shared(mode == lock_mode::shared) {
 }
 
 lock::impl::~impl() {
@@ -293,6 +295,46 @@ size_t lock::impl::get_data_length(format f) const {
   }
 }
 
+bool lock::impl::get_data_stream(format f, const data_stream_callback& callback) const {
+  @autoreleasepool {
+    if (!is_convertible(f))
+      return false;
+
+    NSPasteboard* pasteboard = [NSPasteboard generalPasteboard];
+
+    if (f == text_format()) {
+      NSString* string = [pasteboard stringForType:NSPasteboardTypeString];
+      const char* utf8 = [string UTF8String];
+      if (!utf8)
+        return false;
+
+      size_t len = [string lengthOfBytesUsingEncoding:NSUTF8StringEncoding];
+      if (len > 0)
+        callback(utf8, len);
+      return true;
+    }
+
+    auto it = g_format_to_name.find(f);
+    if (it == g_format_to_name.end())
+      return false;
+
+    const std::string& formatName = it->second;
+    NSString* typeString =
+      [[NSString alloc] initWithBytesNoCopy:(void*)formatName.c_str()
+                                     length:formatName.size()
+                                   encoding:NSUTF8StringEncoding
+                               freeWhenDone:NO];
+
+    NSData* data = [pasteboard dataForType:typeString];
+    if (!data)
+      return false;
+
+    if (data.length > 0)
+      callback((const char*)data.bytes, data.length);
+    return true;
+  }
+}
+
 #if CLIP_ENABLE_IMAGE
 
 bool lock::impl::set_image(const image& image) {
@@ -374,4 +416,8 @@ format register_format(const std::string& name) {
   return new_format;
 }
 
+size_t change_count() {
+  return [[NSPasteboard generalPasteboard] changeCount];
+}
+
 } // namespace clip
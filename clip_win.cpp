@@ -81,12 +81,20 @@ private:
 
 } // anonymous namespace
 
-lock::impl::impl(void* hwnd) : m_locked(false) {
-  for (int i=0; i<5; ++i) {
+lock::impl::impl(void* hwnd, int timeout_msecs, lock_mode mode)
+  : m_locked(false)
+  , m_shared(mode == lock_mode::shared) {
+  // There is no way to wait for the clipboard to be available, so we
+  // retry until the timeout is reached.
+  const DWORD start = GetTickCount();
+  while (true) {
     if (OpenClipboard((HWND)hwnd)) {
       m_locked = true;
       break;
     }
+    m_contended = true;
+    if (int(GetTickCount() - start) >= timeout_msecs)
+      break;
     Sleep(20);
   }
 
@@ -283,6 +291,48 @@ size_t lock::impl::get_data_length(format f) const {
   return len;
 }
 
+bool lock::impl::get_data_stream(format f, const data_stream_callback& callback) const {
+  if (!is_convertible(f))
+    return false;
+
+  // Text must be converted from UTF-16 to UTF-8, so we need a
+  // temporary buffer anyway.
+  if (f == text_format()) {
+    size_t len = get_data_length(f);
+    if (len == 0)
+      return false;
+
+    std::vector<char> buf(len);
+    if (!get_data(f, &buf[0], len))
+      return false;
+
+    len = strnlen(&buf[0], len);
+    if (len > 0)
+      callback(&buf[0], len);
+    return true;
+  }
+
+  bool result = false;
+  HGLOBAL hglobal = GetClipboardData(f);
+  if (hglobal) {
+    const SIZE_T total_size = GlobalSize(hglobal);
+    auto ptr = (const uint8_t*)GlobalLock(hglobal);
+    if (ptr) {
+      CustomSizeT reqsize = *((CustomSizeT*)ptr);
+
+      assert(reqsize <= total_size);
+      if (reqsize > total_size)
+        reqsize = total_size - sizeof(CustomSizeT);
+
+      if (reqsize > 0)
+        callback((const char*)(ptr+sizeof(CustomSizeT)), reqsize);
+      result = true;
+      GlobalUnlock(hglobal);
+    }
+  }
+  return result;
+}
+
 #if CLIP_ENABLE_LIST_FORMATS
 
 std::vector<format_info> lock::impl::list_formats() const {
@@ -405,4 +455,8 @@ format register_format(const std::string& name) {
   return (format)RegisterClipboardFormatW(&buf[0]);
 }
 
+size_t change_count() {
+  return GetClipboardSequenceNumber();
+}
+
 } // namespace clip
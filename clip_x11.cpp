@@ -8,19 +8,32 @@
 #include "clip_lock_impl.h"
 
 #include <xcb/xcb.h>
+#ifdef HAVE_XCB_XFIXES_H
+  #include <xcb/xfixes.h>
+#endif
+
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
 
 #include <atomic>
 #include <algorithm>
 #include <cassert>
+#include <chrono>
+#include <cmath>
 #include <condition_variable>
 #include <cstdint>
 #include <cstdlib>
 #include <cstring>
+#include <deque>
 #include <functional>
+#include <future>
+#include <limits>
 #include <map>
 #include <memory>
 #include <mutex>
 #include <thread>
+#include <unordered_map>
 #include <vector>
 
 #if CLIP_ENABLE_IMAGE && HAVE_PNG_H
@@ -38,13 +51,13 @@ enum CommonAtom {
   INCR,
   TARGETS,
   CLIPBOARD,
+  ATOM_PAIR,
+  MULTIPLE,
 #ifdef HAVE_PNG_H
   MIME_IMAGE_PNG,
 #endif
 #ifdef CLIP_SUPPORT_SAVE_TARGETS
-  ATOM_PAIR,
   SAVE_TARGETS,
-  MULTIPLE,
   CLIPBOARD_MANAGER,
 #endif
 };
@@ -54,33 +67,245 @@ const char* kCommonAtomNames[] = {
   "INCR",
   "TARGETS",
   "CLIPBOARD",
+  "ATOM_PAIR",
+  "MULTIPLE",
 #ifdef HAVE_PNG_H
   "image/png",
 #endif
 #ifdef CLIP_SUPPORT_SAVE_TARGETS
-  "ATOM_PAIR",
   "SAVE_TARGETS",
-  "MULTIPLE",
   "CLIPBOARD_MANAGER",
 #endif
 };
 
 const int kBaseForCustomFormats = 100;
 
+// Maximum number of transfers (data from the selection owner in a
+// specific format) that we keep in the cache.
+const size_t kMaxCachedTransfers = 8;
+
+// Interval (in milliseconds) to check if the active requests were
+// cancelled while we wait for X11 events in threadless mode (the
+// background thread is woken up by cancel_token::cancel()).
+const int kCancelCheckInterval = 10;
+
+// Maximum number of requests to selection owners that can be in
+// progress at the same time (each one uses its own property).
+const size_t kMaxActiveRequests = 16;
+
+// Minimum time (in milliseconds) to wait for an answer of a selection
+// owner when the adaptive timeout is enabled.
+const int kMinAdaptiveTimeout = 100;
+
+// Maximum number of selection owners that we keep track of their
+// latency (for the adaptive timeout).
+const size_t kMaxOwnerLatencies = 64;
+
+// Number of 32-bit units that we read in each GetProperty request
+// (1MB), so big properties are read in several bounded slices.
+const uint32_t kPropertySliceLength = 0x40000;
+
+// Data size that we can send in one ChangeProperty request in the
+// worst case (the X11 protocol guarantees that requests of up to
+// 16384 bytes are accepted).
+const size_t kMinMaxPropertySize = 16384 - 32;
+
+// Used to free the replies/events allocated by xcb.
+struct FreeDeleter {
+  void operator()(void* ptr) const { free(ptr); }
+};
+
+typedef std::unique_ptr<xcb_get_property_reply_t, FreeDeleter> property_reply_ptr;
+
+// Data received from the selection owner. Instead of concatenating
+// the data of each GetProperty reply in a contiguous buffer, we keep
+// the replies as they were received by xcb (one segment for each
+// reply) so the data is copied just once, when it's read.
+class ReplyBuffer {
+public:
+  struct Segment {
+    const uint8_t* data;
+    size_t size;
+  };
+
+  ReplyBuffer() : m_size(0) { }
+
+  bool empty() const { return m_size == 0; }
+  size_t size() const { return m_size; }
+  const std::vector<Segment>& segments() const { return m_segments; }
+
+  // Takes the ownership of the given reply.
+  void append(xcb_get_property_reply_t* reply) {
+    property_reply_ptr ptr(reply);
+    const int n = xcb_get_property_value_length(reply);
+    if (n <= 0)
+      return;
+
+    m_segments.push_back(
+      Segment{ (const uint8_t*)xcb_get_property_value(reply), size_t(n) });
+    m_replies.push_back(std::move(ptr));
+    m_size += n;
+  }
+
+  void clear() {
+    m_segments.clear();
+    m_replies.clear();
+    m_size = 0;
+  }
+
+  void swap(ReplyBuffer& other) {
+    m_segments.swap(other.m_segments);
+    m_replies.swap(other.m_replies);
+    std::swap(m_size, other.m_size);
+  }
+
+  // Copies up to "len" bytes of the data to "dst" and returns the
+  // number of copied bytes.
+  size_t copy_to(uint8_t* dst, size_t len) const {
+    size_t copied = 0;
+    for (const Segment& seg : m_segments) {
+      const size_t n = std::min(len - copied, seg.size);
+      std::copy(seg.data, seg.data+n, dst+copied);
+      copied += n;
+      if (copied == len)
+        break;
+    }
+    return copied;
+  }
+
+  // Returns a pointer to the whole data in a contiguous block of
+  // memory. If the data was received in several replies, the segments
+  // are gathered in the given "storage".
+  const uint8_t* contiguous_data(std::vector<uint8_t>& storage) const {
+    if (m_segments.empty())
+      return nullptr;
+    else if (m_segments.size() == 1)
+      return m_segments[0].data;
+
+    storage.resize(m_size);
+    copy_to(&storage[0], m_size);
+    return &storage[0];
+  }
+
+private:
+  std::vector<Segment> m_segments;
+  std::vector<property_reply_ptr> m_replies;
+  size_t m_size;
+};
+
+typedef std::shared_ptr<ReplyBuffer> reply_buffer_ptr;
+
+// Mutex that can be locked by several readers at the same time
+// (std::shared_timed_mutex is not available in C++11). Waiting
+// writers have priority over new readers.
+class SharedMutex {
+public:
+  void lock() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    ++m_waiting_writers;
+    m_cv.wait(lock, [this]{ return !m_writer && m_readers == 0; });
+    --m_waiting_writers;
+    m_writer = true;
+  }
+
+  void unlock() {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_writer = false;
+    }
+    m_cv.notify_all();
+  }
+
+  void lock_shared() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_cv.wait(lock, [this]{ return !m_writer && m_waiting_writers == 0; });
+    ++m_readers;
+  }
+
+  void unlock_shared() {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      --m_readers;
+    }
+    m_cv.notify_all();
+  }
+
+private:
+  std::mutex m_mutex;
+  std::condition_variable m_cv;
+  bool m_writer = false;
+  size_t m_readers = 0;
+  size_t m_waiting_writers = 0;
+};
+
+class SharedLockGuard {
+public:
+  explicit SharedLockGuard(SharedMutex& mutex) : m_mutex(mutex) {
+    m_mutex.lock_shared();
+  }
+  ~SharedLockGuard() {
+    m_mutex.unlock_shared();
+  }
+private:
+  SharedMutex& m_mutex;
+};
+
+class Manager;
+
+// Existing managers, so cancel_token::cancel() can wake up their
+// background threads.
+std::mutex managers_mutex;
+std::vector<Manager*> managers;
+
 class Manager {
 public:
   typedef std::shared_ptr<std::vector<uint8_t>> buffer_ptr;
+  typedef std::map<xcb_atom_t, buffer_ptr> data_map;
   typedef std::vector<xcb_atom_t> atoms;
-  typedef std::function<bool()> notify_callback;
-
-  Manager()
-    : m_lock(m_mutex, std::defer_lock)
-    , m_connection(xcb_connect(nullptr, nullptr))
-    , m_window(0)
-    , m_incr_process(false) {
+  typedef std::function<bool(const ReplyBuffer& data)> notify_callback;
+  typedef std::function<void(bool ok, const ReplyBuffer& data)> async_callback;
+
+  // A thread that has locked the Manager.
+  struct LockHolder {
+    std::thread::id thread;
+    bool shared;
+
+    // When the requests to selection owners made with this lock
+    // fail (see lock::set_x11_read_timeout()).
+    std::chrono::steady_clock::time_point deadline;
+  };
+
+  // If "connection" is not nullptr, we use the connection (and the
+  // window) of the application, and its events are given to us by
+  // the application (see handle_external_event()). In other case we
+  // connect to the given "display" (or $DISPLAY if it's nullptr).
+  // Only the default Manager (without "display") can be threadless.
+  Manager(xcb_connection_t* connection,
+          const xcb_window_t window,
+          const char* display = nullptr)
+    : m_connection(connection ? connection: xcb_connect(display, nullptr))
+    , m_window(connection ? window: 0)
+    , m_external(connection != nullptr)
+    , m_threadless((get_x11_threadless() && !display) || m_external)
+    , m_pump_thread(std::thread::id())
+    , m_queued_events(false)
+    , m_stopped(true)
+    , m_change_count(1)
+    , m_transfer_cache_hits(0)
+    , m_transfer_cache_misses(0)
+    , m_prefetches(0)
+    , m_coalesced_reads(0)
+    , m_ownership_errors(0)
+    , m_owner_pending(false)
+    , m_owner_sequence(0)
+    , m_max_property_size(0) {
     if (!m_connection)
       return;
 
+    // Intern all the atoms that we use in just one round trip, before
+    // the background thread starts using them.
+    init_atoms();
+
     const xcb_setup_t* setup = xcb_get_setup(m_connection);
     if (!setup)
       return;
@@ -96,72 +321,347 @@ public:
       // To receive DestroyNotify event and stop the message loop.
       XCB_EVENT_MASK_STRUCTURE_NOTIFY;
 
-    m_window = xcb_generate_id(m_connection);
-    xcb_create_window(m_connection, 0,
-                      m_window,
-                      screen->root,
-                      0, 0, 1, 1, 0,
-                      XCB_WINDOW_CLASS_INPUT_OUTPUT,
-                      screen->root_visual,
-                      XCB_CW_EVENT_MASK,
-                      &event_mask);
-
-    m_thread = std::thread(
-      [this]{
-        process_x11_events();
-      });
+    if (m_external) {
+      // Add the events that we need to the events that the
+      // application already receives in its window.
+      xcb_get_window_attributes_reply_t* attrs =
+        xcb_get_window_attributes_reply(
+          m_connection,
+          xcb_get_window_attributes(m_connection, m_window),
+          nullptr);
+      if (attrs) {
+        event_mask |= attrs->your_event_mask;
+        free(attrs);
+      }
+      xcb_change_window_attributes(m_connection,
+                                   m_window,
+                                   XCB_CW_EVENT_MASK,
+                                   &event_mask);
+    }
+    else {
+      m_window = xcb_generate_id(m_connection);
+      xcb_create_window(m_connection, 0,
+                        m_window,
+                        screen->root,
+                        0, 0, 1, 1, 0,
+                        XCB_WINDOW_CLASS_INPUT_OUTPUT,
+                        screen->root_visual,
+                        XCB_CW_EVENT_MASK,
+                        &event_mask);
+    }
+
+    // Pipe used to wake up the background thread when a new request
+    // is added (or cancelled).
+    if (pipe(m_wake_pipe) == 0) {
+      fcntl(m_wake_pipe[0], F_SETFL, O_NONBLOCK);
+      fcntl(m_wake_pipe[1], F_SETFL, O_NONBLOCK);
+    }
+    else {
+      m_wake_pipe[0] = m_wake_pipe[1] = -1;
+    }
+    {
+      std::lock_guard<std::mutex> lock(managers_mutex);
+      managers.push_back(this);
+    }
+
+#ifdef HAVE_XCB_XFIXES_H
+    init_xfixes();
+#endif
+
+    m_stopped = false;
+
+    // In threadless mode the events are processed by the user threads
+    // (see pump_x11_events()).
+    if (!m_threadless) {
+      m_thread = std::thread(
+        [this]{
+          process_x11_events();
+        });
+    }
   }
 
   ~Manager() {
 #ifdef CLIP_SUPPORT_SAVE_TARGETS
-    if (!m_data.empty() &&
-        m_window &&
-        m_window == get_x11_selection_owner()) {
-      // If the CLIPBOARD_MANAGER atom is not 0, we assume that there
-      // is a clipboard manager available were we can leave our data.
-      xcb_atom_t x11_clipboard_manager = get_atom(CLIPBOARD_MANAGER);
-      if (x11_clipboard_manager) {
-        // We have to lock the m_lock mutex that will be used to wait
-        // the m_cv condition in get_data_from_selection_owner().
-        if (try_lock()) {
-          // Start the SAVE_TARGETS mechanism so the X11
-          // CLIPBOARD_MANAGER will save our clipboard data
-          // from now on.
-          get_data_from_selection_owner(
-            { get_atom(SAVE_TARGETS) },
-            []() -> bool { return true; },
-            x11_clipboard_manager);
-        }
-      }
+    // Give our clipboard data to the X11 CLIPBOARD_MANAGER (if it
+    // wasn't saved with persist() already), waiting at most
+    // get_x11_persist_timeout().
+    if (!m_data.empty()) {
+      if (request_ptr req = start_persist(persist_callback()))
+        wait_request(req);
     }
 #endif
 
-    if (m_window) {
+    if (m_window && !m_external) {
       xcb_destroy_window(m_connection, m_window);
       xcb_flush(m_connection);
     }
 
     if (m_thread.joinable())
       m_thread.join();
+    else if (m_threadless) {
+      std::lock_guard<std::mutex> lock(m_pump_mutex);
+      stop_requests();
+    }
+    if (m_encode_thread.joinable())
+      m_encode_thread.join();
+
+    {
+      std::lock_guard<std::mutex> lock(managers_mutex);
+      managers.erase(std::remove(managers.begin(), managers.end(), this),
+                     managers.end());
+    }
+    for (int fd : m_wake_pipe) {
+      if (fd >= 0)
+        close(fd);
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(m_requests_mutex);
+      for (xcb_generic_event_t* event : m_external_events)
+        free(event);
+    }
 
-    if (m_connection)
+    if (m_connection && !m_external)
       xcb_disconnect(m_connection);
   }
 
-  bool try_lock() {
-    bool res = m_lock.try_lock();
-    if (!res) {
-      // TODO make this configurable (the same for Windows retries)
-      for (int i=0; i<5 && !res; ++i) {
-        res = m_lock.try_lock();
-        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  // Locks the Manager waiting at most "timeout_msecs" milliseconds.
+  // Threads waiting for the lock get it in the same order they asked
+  // for it (consecutive "shared" threads get it at the same time).
+  bool try_lock(const int timeout_msecs,
+                const bool shared,
+                bool* contended = nullptr) {
+    {
+      std::unique_lock<std::mutex> lock(m_lock_mutex);
+      if (!m_lock_waiters.empty() || !can_lock(shared)) {
+        if (contended)
+          *contended = true;
+
+        // The thread that holds the lock could be waiting for us to
+        // process its request (see wait_request()).
+        if (is_event_thread())
+          return false;
+
+        const auto deadline =
+          std::chrono::steady_clock::now() +
+          std::chrono::milliseconds(timeout_msecs);
+        const size_t ticket = m_next_lock_ticket++;
+        m_lock_waiters.push_back(ticket);
+
+        const bool result =
+          m_lock_cv.wait_until(lock, deadline, [this, ticket, shared]{
+                                 return (m_lock_waiters.front() == ticket &&
+                                         can_lock(shared));
+                               });
+
+        m_lock_waiters.erase(std::find(m_lock_waiters.begin(),
+                                       m_lock_waiters.end(),
+                                       ticket));
+
+        // The next thread could be the first one now (or it can
+        // share the lock with us).
+        m_lock_cv.notify_all();
+        if (!result)
+          return false;
       }
+      m_lock_holders.push_back(
+        LockHolder{ std::this_thread::get_id(), shared,
+                    std::chrono::steady_clock::time_point::max() });
     }
-    return res;
+    if (shared)
+      m_mutex.lock_shared();
+    else
+      m_mutex.lock();
+    return true;
+  }
+
+  // Sets the deadline of the requests made with the lock of the
+  // current thread.
+  void set_read_deadline(const std::chrono::steady_clock::time_point deadline) {
+    std::lock_guard<std::mutex> lock(m_lock_mutex);
+    auto it = find_lock_holder();
+    if (it != m_lock_holders.end())
+      m_lock_holders[it - m_lock_holders.begin()].deadline = deadline;
   }
 
   void unlock() {
-    m_lock.unlock();
+    const bool shared = is_shared_lock();
+
+    // Take the clipboard ownership just one time for all the changes
+    // made in this lock.
+    const bool committed = (!shared && m_owner_pending);
+    if (committed)
+      commit_selection_owner();
+
+    // If we don't receive XFixes events, we cannot know if the owner
+    // will change its content after this lock, so we have to discard
+    // the data received from it (and the targets that it refused,
+    // as the same window could have new content).
+    if (!m_xfixes) {
+      {
+        std::lock_guard<std::mutex> lock(m_transfer_cache_mutex);
+        m_transfer_cache.clear();
+      }
+      std::lock_guard<std::mutex> lock(m_selection_mutex);
+      m_refused_owner = 0;
+      m_refused_targets.clear();
+    }
+
+    if (shared)
+      m_mutex.unlock_shared();
+    else
+      m_mutex.unlock();
+    {
+      std::lock_guard<std::mutex> lock(m_lock_mutex);
+      m_lock_holders.erase(find_lock_holder());
+    }
+    m_lock_cv.notify_all();
+
+    process_queued_events();
+
+#ifdef CLIP_SUPPORT_SAVE_TARGETS
+    if (committed && get_x11_auto_persist())
+      start_persist(persist_callback());
+#endif
+  }
+
+  watch_id watch(const watch_callback& callback) {
+    if (!m_xfixes)
+      return 0;
+
+    std::lock_guard<std::mutex> lock(m_watchers_mutex);
+    const watch_id id = m_next_watch_id++;
+    m_watchers[id] = callback;
+    return id;
+  }
+
+  void unwatch(const watch_id id) {
+    std::lock_guard<std::mutex> lock(m_watchers_mutex);
+    m_watchers.erase(id);
+  }
+
+  size_t change_count() const {
+    // Without XFixes we don't know if the content has changed, so we
+    // have to assume that it did (but the data in cache is still
+    // valid until the lock is released).
+    if (!m_xfixes)
+      return ++m_change_count;
+    return get_selection_serial();
+  }
+
+  x11_stats get_stats() const {
+    x11_stats stats;
+    stats.cache_hits = m_transfer_cache_hits;
+    stats.cache_misses = m_transfer_cache_misses;
+    stats.prefetches = m_prefetches;
+    stats.coalesced = m_coalesced_reads;
+    stats.ownership_errors = m_ownership_errors;
+    return stats;
+  }
+
+  int get_fd() const {
+    return (m_connection ? xcb_get_file_descriptor(m_connection): -1);
+  }
+
+  // Called by the application to give us an event received in its
+  // connection. Returns true if the event was for us only.
+  bool handle_external_event(const xcb_generic_event_t* event) {
+    if (!m_external)
+      return false;
+
+    bool ours = false;
+    bool useful = false;
+    switch (event->response_type & ~0x80) {
+
+      case XCB_SELECTION_CLEAR:
+        ours = useful =
+          (((const xcb_selection_clear_event_t*)event)->selection == get_atom(CLIPBOARD));
+        break;
+
+      case XCB_SELECTION_REQUEST:
+        ours = useful =
+          (((const xcb_selection_request_event_t*)event)->selection == get_atom(CLIPBOARD));
+        break;
+
+      // A refused conversion (property None) doesn't say which
+      // property it was for, and it could be a request of the
+      // application in the same window, so we ignore it (our request
+      // will fail with the wait timeout).
+      case XCB_SELECTION_NOTIFY:
+        ours = useful =
+          is_our_property(((const xcb_selection_notify_event_t*)event)->property);
+        break;
+
+      case XCB_PROPERTY_NOTIFY: {
+        auto notify = (const xcb_property_notify_event_t*)event;
+        ours = (notify->window == m_window && is_our_property(notify->atom));
+        // A requestor could have read a chunk of an INCR transfer.
+        useful = (ours || notify->state == XCB_PROPERTY_DELETE);
+        break;
+      }
+
+      case XCB_DESTROY_NOTIFY:
+        useful = true;
+        break;
+
+#ifdef HAVE_XCB_XFIXES_H
+      default:
+        if (m_xfixes &&
+            (event->response_type & ~0x80) == m_xfixes_event_base + XCB_XFIXES_SELECTION_NOTIFY) {
+          auto notify = (const xcb_xfixes_selection_notify_event_t*)event;
+          ours = useful = (notify->window == m_window &&
+                           notify->selection == get_atom(CLIPBOARD));
+        }
+        break;
+#endif
+    }
+
+    if (useful) {
+      auto copy = (xcb_generic_event_t*)malloc(sizeof(xcb_generic_event_t));
+      if (copy) {
+        std::memcpy(copy, event, sizeof(xcb_generic_event_t));
+        {
+          std::lock_guard<std::mutex> lock(m_requests_mutex);
+          m_external_events.push_back(copy);
+        }
+        wake_up_event_thread();
+        if (m_pump_thread != std::this_thread::get_id()) {
+          wait_unlocked(
+            [this]{
+              pump_x11_events(0);
+            });
+        }
+      }
+    }
+    return ours;
+  }
+
+  // Processes the pending events in threadless mode without blocking.
+  int dispatch_pending() {
+    if (!m_threadless)
+      return -1;
+
+    std::unique_lock<std::mutex> lock(m_pump_mutex, std::try_to_lock);
+    // Other thread is processing the events, so we can check again
+    // later.
+    if (!lock.owns_lock())
+      return kCancelCheckInterval;
+
+    int timeout = -1;
+    if (!is_stopped()) {
+      m_pump_thread = std::this_thread::get_id();
+      if (!process_x11_events_once(0, timeout))
+        stop_requests();
+      m_pump_thread = std::thread::id();
+    }
+    lock.unlock();
+
+    // Events queued by a round trip of other thread while we were
+    // processing the events (see after_round_trip()), the X11 file
+    // descriptor will not be readable for them.
+    if (m_queued_events && !is_stopped())
+      return 0;
+    return timeout;
   }
 
   // Clear our data
@@ -175,32 +675,10 @@ public:
   void clear() {
     clear_data();
 
-    // As we want to clear the clipboard content, we set us as the new
-    // clipboard owner (with an empty clipboard). If this fails, we'll
-    // try to send a XCB_SELECTION_CLEAR request to the real owner
-    // (but that can fail anyway because it's a request that the owner
-    // could ignore).
-    if (set_x11_selection_owner())
-      return;
-
-    // Clear the clipboard data from the selection owner
-    const xcb_window_t owner = get_x11_selection_owner();
-    if (m_window != owner) {
-      xcb_selection_clear_event_t event;
-      event.response_type = XCB_SELECTION_CLEAR;
-      event.pad0          = 0;
-      event.sequence      = 0;
-      event.time          = XCB_CURRENT_TIME;
-      event.owner         = owner;
-      event.selection     = get_atom(CLIPBOARD);
-
-      xcb_send_event(m_connection, false,
-                     owner,
-                     XCB_EVENT_MASK_NO_EVENT,
-                     (const char*)&event);
-
-      xcb_flush(m_connection);
-    }
+    // As we want to clear the clipboard content, we'll set us as the
+    // new clipboard owner (with an empty clipboard) when the lock is
+    // released.
+    m_owner_pending = true;
   }
 
   bool is_convertible(format f) const {
@@ -217,40 +695,30 @@ public:
     }
     // Ask to the selection owner the available formats/atoms/targets.
     else if (owner) {
-      return
-        get_data_from_selection_owner(
-          { get_atom(TARGETS) },
-          [this, &atoms]() -> bool {
-            assert(m_reply_data);
-            if (!m_reply_data)
-              return false;
-
-            const xcb_atom_t* sel_atoms = (const xcb_atom_t*)&(*m_reply_data)[0];
-            int sel_natoms = m_reply_data->size() / sizeof(xcb_atom_t);
-            auto atoms_begin = atoms.begin();
-            auto atoms_end = atoms.end();
-            for (int i=0; i<sel_natoms; ++i) {
-              if (std::find(atoms_begin,
-                            atoms_end,
-                            sel_atoms[i]) != atoms_end) {
-                return true;
-              }
-            }
-            return false;
-          });
+      std::vector<xcb_atom_t> targets;
+      if (!get_selection_targets(targets))
+        return false;
+
+      for (xcb_atom_t atom : atoms) {
+        if (std::find(targets.begin(),
+                      targets.end(),
+                      atom) != targets.end()) {
+          return true;
+        }
+      }
     }
 
     return false;
   }
 
   bool set_data(format f, const char* buf, size_t len) {
-    if (!set_x11_selection_owner())
-      return false;
-
     const atoms atoms = get_format_atoms(f);
     if (atoms.empty())
       return false;
 
+    // We'll take the clipboard ownership when the lock is released.
+    m_owner_pending = true;
+
     buffer_ptr shared_data_buf = std::make_shared<std::vector<uint8_t>>(len);
     std::copy(buf,
               buf+len,
@@ -285,12 +753,11 @@ public:
     }
     else if (owner) {
       if (get_data_from_selection_owner(
-            atoms,
-            [this, buf, len, f]() -> bool {
-              size_t n = std::min(len, m_reply_data->size());
-              std::copy(m_reply_data->begin(),
-                        m_reply_data->begin()+n,
-                        buf);
+            make_request(atoms),
+            [buf, len, f](const ReplyBuffer& data) -> bool {
+              // Gather all the received segments directly in the
+              // user buffer.
+              size_t n = data.copy_to((uint8_t*)buf, len);
 
               if (f == text_format()) {
                 if (n < len)
@@ -305,6 +772,100 @@ public:
     return false;
   }
 
+  bool get_data_stream(format f, const data_stream_callback& callback) const {
+    const atoms atoms = get_format_atoms(f);
+    const xcb_window_t owner = get_x11_selection_owner();
+    if (owner == m_window) {
+      for (xcb_atom_t atom : atoms) {
+        auto it = m_data.find(atom);
+        if (it != m_data.end() && it->second) {
+          if (!it->second->empty())
+            callback((const char*)&(*it->second)[0], it->second->size());
+          return true;
+        }
+      }
+    }
+    else if (owner) {
+      // The data will be given to the callback directly from
+      // add_reply_data() as each chunk/slice is received.
+      request_ptr req = make_request(atoms);
+      req->stream = callback;
+      return get_data_from_selection_owner(
+        req,
+        [](const ReplyBuffer&) -> bool { return true; });
+    }
+    return false;
+  }
+
+  bool get_many(const std::vector<format>& formats,
+                std::vector<std::vector<char>>& output) const {
+    output.assign(formats.size(), std::vector<char>());
+    std::vector<bool> received(formats.size(), false);
+
+    // Ask for all formats to the selection owner in just one MULTIPLE
+    // conversion, using the preferred target of each format that the
+    // owner supports.
+    const xcb_window_t owner = get_x11_selection_owner();
+    if (owner && owner != m_window && formats.size() > 1) {
+      const size_t serial = get_selection_serial();
+      request_ptr req = make_request({ get_atom(MULTIPLE) });
+      req->mode = Request::Multiple;
+
+      std::vector<size_t> indexes;
+      for (size_t i=0; i<formats.size(); ++i) {
+        atoms atoms = get_format_atoms(formats[i]);
+        if (atoms.size() > 1)
+          select_supported_targets(owner, atoms);
+        if (atoms.empty())
+          continue;
+
+        Request::Part part;
+        part.target = atoms[0];
+        req->parts.push_back(std::move(part));
+        indexes.push_back(i);
+      }
+
+      if (!req->parts.empty() &&
+          get_data_from_selection_owner(
+            req,
+            [](const ReplyBuffer&) -> bool { return true; })) {
+        for (size_t j=0; j<req->parts.size(); ++j) {
+          Request::Part& part = req->parts[j];
+          if (!part.ok)
+            continue;
+
+          std::vector<char>& buf = output[indexes[j]];
+          buf.resize(part.data.size());
+          if (!buf.empty())
+            part.data.copy_to((uint8_t*)&buf[0], buf.size());
+          received[indexes[j]] = true;
+
+          reply_buffer_ptr data = std::make_shared<ReplyBuffer>();
+          data->swap(part.data);
+          add_cached_transfer(owner, serial, part.target, data);
+        }
+      }
+    }
+
+    // Formats that were not received in the MULTIPLE conversion (or
+    // if we are the owner) are requested one by one.
+    bool result = true;
+    for (size_t i=0; i<formats.size(); ++i) {
+      if (received[i])
+        continue;
+
+      std::vector<char>& buf = output[i];
+      if (!get_data_stream(formats[i],
+                           [&buf](const char* data, size_t len) {
+                             buf.insert(buf.end(), data, data+len);
+                           })) {
+        buf.clear();
+        result = false;
+      }
+    }
+    return result;
+  }
+
   size_t get_data_length(format f) const {
     size_t len = 0;
     const atoms atoms = get_format_atoms(f);
@@ -319,14 +880,25 @@ public:
       }
     }
     else if (owner) {
-      if (!get_data_from_selection_owner(
-            atoms,
-            [this, &len]() -> bool {
-              len = m_reply_data->size();
-              return true;
-            })) {
-        // Error getting data length
-        return 0;
+      // If we've already received the data, we know its size.
+      if (reply_buffer_ptr data = find_cached_transfer(owner, atoms)) {
+        ++m_transfer_cache_hits;
+        len = data->size();
+      }
+      else {
+        // Ask only for the length of the data, without transferring
+        // the data itself.
+        request_ptr req = make_request(atoms);
+        req->mode = Request::LengthOnly;
+        if (!get_data_from_selection_owner(
+              req,
+              [&req, &len](const ReplyBuffer&) -> bool {
+                len = req->length;
+                return true;
+              })) {
+          // Error getting data length
+          return 0;
+        }
       }
     }
     if (f == text_format() && len > 0) {
@@ -338,10 +910,11 @@ public:
 #if CLIP_ENABLE_IMAGE
 
   bool set_image(const image& image) {
-    if (!set_x11_selection_owner())
-      return false;
+    // We'll take the clipboard ownership when the lock is released.
+    m_owner_pending = true;
 
     m_image = image;
+    ++m_image_generation;
 
 #ifdef HAVE_PNG_H
     // Put a nullptr in the m_data for image/png format and then we'll
@@ -361,15 +934,41 @@ public:
       }
     }
 #ifdef HAVE_PNG_H
-    else if (owner &&
-             get_data_from_selection_owner(
-               { get_atom(MIME_IMAGE_PNG) },
-               [this, &output_img]() -> bool {
-                 return x11::read_png(&(*m_reply_data)[0],
-                                      m_reply_data->size(),
-                                      &output_img, nullptr);
-               })) {
-      return true;
+    else if (owner) {
+      // Only one thread decodes the image of the selection owner, the
+      // others get a copy of the decoded image. Without XFixes the
+      // image cannot be reused (see below), so each thread decodes
+      // its own image in parallel.
+      std::unique_lock<std::mutex> lock(m_decoded_image_mutex, std::defer_lock);
+      if (m_xfixes)
+        wait_unlocked([&lock]{ lock.lock(); });
+      const size_t serial = get_selection_serial();
+      if (m_xfixes &&
+          m_decoded_image.is_valid() &&
+          m_decoded_image_owner == owner &&
+          m_decoded_image_serial == serial) {
+        ++m_coalesced_reads;
+        output_img = m_decoded_image;
+        return true;
+      }
+
+      if (get_data_from_selection_owner(
+            make_request({ get_atom(MIME_IMAGE_PNG) }),
+            [&output_img](const ReplyBuffer& data) -> bool {
+              std::vector<uint8_t> storage;
+              return x11::read_png(data.contiguous_data(storage),
+                                   data.size(),
+                                   &output_img, nullptr);
+            })) {
+        // Without XFixes the serial doesn't change when the owner
+        // changes its content, so we cannot reuse the image.
+        if (m_xfixes) {
+          m_decoded_image = output_img;
+          m_decoded_image_owner = owner;
+          m_decoded_image_serial = serial;
+        }
+        return true;
+      }
     }
 #endif
     return false;
@@ -386,10 +985,11 @@ public:
 #ifdef HAVE_PNG_H
     else if (owner &&
              get_data_from_selection_owner(
-               { get_atom(MIME_IMAGE_PNG) },
-               [this, &spec]() -> bool {
-                 return x11::read_png(&(*m_reply_data)[0],
-                                      m_reply_data->size(),
+               make_request({ get_atom(MIME_IMAGE_PNG) }),
+               [&spec](const ReplyBuffer& data) -> bool {
+                 std::vector<uint8_t> storage;
+                 return x11::read_png(data.contiguous_data(storage),
+                                      data.size(),
                                       nullptr, &spec);
                })) {
       return true;
@@ -401,75 +1001,431 @@ public:
 #endif // CLIP_ENABLE_IMAGE
 
   format register_format(const std::string& name) {
-    xcb_atom_t atom = get_atom(name.c_str());
-    m_custom_formats.push_back(atom);
-    return (format)(m_custom_formats.size()-1) + kBaseForCustomFormats;
+    return register_formats({ name })[0];
+  }
+
+  // Registers all the given format names interning their atoms in
+  // just one round trip. A name that was already registered returns
+  // the same format.
+  std::vector<format> register_formats(const std::vector<std::string>& names) {
+    std::vector<const char*> cnames;
+    for (const auto& name : names)
+      cnames.push_back(name.c_str());
+    const atoms atoms = get_atoms(cnames.data(), int(cnames.size()));
+
+    std::vector<format> result;
+    {
+      std::lock_guard<std::mutex> lock(m_atoms_mutex);
+      for (xcb_atom_t atom : atoms) {
+        if (!atom) {
+          result.push_back(empty_format());
+          continue;
+        }
+
+        auto it = std::find(m_custom_formats.begin(),
+                            m_custom_formats.end(), atom);
+        if (it == m_custom_formats.end())
+          it = m_custom_formats.insert(it, atom);
+        result.push_back(
+          (format)(it - m_custom_formats.begin()) + kBaseForCustomFormats);
+      }
+    }
+    process_queued_events();
+    return result;
+  }
+
+  // Asks for the clipboard data in the given format without waiting
+  // the answer. The "callback" is called from the background thread
+  // when the data is received (or when the request fails or is
+  // cancelled). Even if we are the clipboard owner, the data is
+  // requested through the X server, so we don't need to lock the
+  // Manager here.
+  void get_data_async(format f,
+                      const cancel_token& token,
+                      const async_callback& callback) {
+    const atoms atoms = get_format_atoms(f);
+    if (atoms.empty()) {
+      callback(false, ReplyBuffer());
+      return;
+    }
+
+    request_ptr req = make_request(atoms);
+    req->token = token;
+    req->on_done =
+      [callback](Request& req) {
+        callback(req.result, req.data);
+      };
+    submit_request(req);
+  }
+
+  void persist(const persist_callback& callback) {
+#ifdef CLIP_SUPPORT_SAVE_TARGETS
+    start_persist(callback);
+#else
+    if (callback)
+      callback(false);
+#endif
+  }
+
+  // Called when a request is cancelled, so the background thread
+  // finishes it right now (see process_requests()).
+  void notify_cancel() const {
+    wake_up_event_thread();
   }
 
 private:
 
+  // A request of the content of a selection (in one of the given
+  // "targets") to the selection owner. Requests are processed by the
+  // background thread, several requests can be in progress at the
+  // same time as each one receives the data in its own property.
+  struct Request {
+    enum Mode {
+      Data,       // Get the data in one of the "targets"
+      LengthOnly, // Get only the length of the data
+      Multiple,   // Get the data of all "parts" (MULTIPLE target)
+    };
+
+    Mode mode = Data;
+    xcb_atom_t selection = 0;
+    atoms targets;
+    cancel_token token;
+
+    // Optional callback to receive the data in chunks instead of
+    // keeping it in "data".
+    data_stream_callback stream;
+
+    // Optional callback called from the background thread when the
+    // request is completed.
+    std::function<void(Request& req)> on_done;
+
+    // If it's not zero, the request fails if the data is bigger than
+    // this size (used to prefetch only small data).
+    size_t max_size = 0;
+
+    // Index of the target in "targets" that we're requesting now.
+    size_t target_index = 0;
+
+    // Targets that the owner refused to convert (a target without
+    // answer in time is not included).
+    atoms refused;
+
+    // Property of our window where the selection owner leaves the
+    // data for this request.
+    xcb_atom_t property = 0;
+
+    // True if we're receiving the data in chunks (INCR method).
+    bool incr = false;
+
+    // When the selection owner must answer (or send the next chunk
+    // of data) before we try the next target.
+    std::chrono::steady_clock::time_point deadline;
+
+    // When the whole request fails (see set_x11_transfer_timeout()).
+    std::chrono::steady_clock::time_point end_time =
+      std::chrono::steady_clock::time_point::max();
+
+    // Selection owner that should answer this request (0 if it's
+    // unknown), and when we asked it for the last time, to measure
+    // its latency.
+    xcb_window_t owner = 0;
+    std::chrono::steady_clock::time_point sent;
+
+    // Selection serial when the request was made (see
+    // get_selection_serial()).
+    size_t serial = 0;
+
+    // Result of the request.
+    bool result = false;
+    ReplyBuffer data;
+    size_t length = 0;
+
+    // Targets requested in one MULTIPLE conversion, each one is
+    // received in its own property.
+    struct Part {
+      xcb_atom_t target = 0;
+      xcb_atom_t property = 0;
+      bool incr = false;
+      bool done = false;
+      bool ok = false;
+      ReplyBuffer data;
+    };
+    std::vector<Part> parts;
+
+    // Used to wait the request from other thread.
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool done = false;
+
+    // For "stream" requests, "streamed" is true when the first chunk
+    // of data was given to the callback, and "keep_data" is true if
+    // the data must be kept in "data" too (because other thread is
+    // waiting for the same data). Guarded by "mutex".
+    bool streamed = false;
+    bool keep_data = false;
+  };
+
+  typedef std::shared_ptr<Request> request_ptr;
+
+  // A request of some data to the CLIPBOARD owner that is in progress,
+  // so other threads asking for the same data can wait for it instead
+  // of starting a new transfer.
+  struct InFlightRead {
+    xcb_window_t owner;
+    size_t serial;
+    atoms targets;
+    request_ptr req;
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool done = false;
+    bool result = false;
+    reply_buffer_ptr data;
+  };
+
+  typedef std::shared_ptr<InFlightRead> in_flight_read_ptr;
+
   void process_x11_events() {
-    bool stop = false;
-    xcb_generic_event_t* event;
-    while (!stop && (event = xcb_wait_for_event(m_connection))) {
-      int type = (event->response_type & ~0x80);
+    int timeout;
+    while (process_x11_events_once(-1, timeout))
+      ;
 
-      switch (type) {
+    // Fail all the requests that cannot be completed now.
+    stop_requests();
+  }
 
-        case XCB_DESTROY_NOTIFY:
-          // To stop the message loop we can just destroy the window
-          stop = true;
-          break;
+  // Processes all the available events, and then waits for more
+  // events, a new request, or the next request timeout, but no more
+  // than "max_wait" milliseconds (-1 to wait without limit, 0 to
+  // return immediately). Returns false if the event loop must be
+  // stopped, and in "next_timeout" the time to call it again if there
+  // are no new events.
+  bool process_x11_events_once(const int max_wait, int& next_timeout) {
+    // We're going to read all the queued events.
+    m_queued_events = false;
 
-        // Someone else has new content in the clipboard, so is
-        // notifying us that we should delete our data now.
-        case XCB_SELECTION_CLEAR:
-          handle_selection_clear_event(
-            (xcb_selection_clear_event_t*)event);
-          break;
+    xcb_generic_event_t* event;
+    while ((event = poll_for_event())) {
+      const bool stop = !handle_event(event);
+      free(event);
+      if (stop)
+        return false;
+    }
+    if (xcb_connection_has_error(m_connection))
+      return false;
 
-          // Someone is requesting the clipboard content from us.
-        case XCB_SELECTION_REQUEST:
-          handle_selection_request_event(
-            (xcb_selection_request_event_t*)event);
-          break;
+    // Answer requests that were waiting for encoded data.
+    process_encoded_data();
 
-          // We've requested the clipboard content and this is the
-          // answer.
-        case XCB_SELECTION_NOTIFY:
-          handle_selection_notify_event(
-            (xcb_selection_notify_event_t*)event);
-          break;
+    // Start new requests and check timeouts/cancellations.
+    int timeout = process_requests();
 
-        case XCB_PROPERTY_NOTIFY:
-          handle_property_notify_event(
-            (xcb_property_notify_event_t*)event);
-          break;
+    // In threadless mode nobody waits for the wake pipe, so the
+    // encoded data and new requests must be checked periodically.
+    if (m_threadless && (m_encode_thread.joinable() || has_pending_requests()))
+      timeout = (timeout < 0 ? kCancelCheckInterval:
+                               std::min(timeout, kCancelCheckInterval));
+    next_timeout = timeout;
+
+    if (max_wait == 0)
+      return true;
+    else if (max_wait > 0)
+      timeout = (timeout < 0 ? max_wait: std::min(timeout, max_wait));
+
+    // Wait for more events, a new request, or the next timeout.
+    pollfd fds[2];
+    // The events of an external connection are read by the
+    // application (poll() ignores negative file descriptors).
+    fds[0].fd = (m_external ? -1: xcb_get_file_descriptor(m_connection));
+    fds[0].events = POLLIN;
+    fds[0].revents = 0;
+    fds[1].fd = m_wake_pipe[0];
+    fds[1].events = POLLIN;
+    fds[1].revents = 0;
+    if (poll(fds, (m_wake_pipe[0] >= 0 ? 2: 1), timeout) > 0 &&
+        (fds[1].revents & POLLIN)) {
+      char buf[64];
+      while (read(m_wake_pipe[0], buf, sizeof(buf)) > 0)
+        ;
+    }
+    return true;
+  }
+
+  // In threadless mode, processes the X11 events in the current
+  // thread waiting at most "max_wait" milliseconds. Returns false if
+  // other thread is already processing the events.
+  bool pump_x11_events(int max_wait) {
+    while (true) {
+      {
+        std::unique_lock<std::mutex> lock(m_pump_mutex, std::try_to_lock);
+        if (!lock.owns_lock())
+          return false;
+
+        if (is_stopped())
+          return true;
 
+        int timeout;
+        m_pump_thread = std::this_thread::get_id();
+        if (!process_x11_events_once(max_wait, timeout))
+          stop_requests();
+        m_pump_thread = std::thread::id();
       }
 
-      free(event);
+      // Other thread could have queued events while we were
+      // processing them, and it couldn't process them because we
+      // had m_pump_mutex locked.
+      if (!m_queued_events)
+        return true;
+      max_wait = 0;
     }
   }
 
-  void handle_selection_clear_event(xcb_selection_clear_event_t* event) {
-    if (event->selection == get_atom(CLIPBOARD)) {
-      std::lock_guard<std::mutex> lock(m_mutex);
-      clear_data(); // Clear our clipboard data
-    }
+  xcb_generic_event_t* poll_for_event() {
+    if (!m_external)
+      return xcb_poll_for_event(m_connection);
+
+    std::lock_guard<std::mutex> lock(m_requests_mutex);
+    if (m_external_events.empty())
+      return nullptr;
+    xcb_generic_event_t* event = m_external_events.front();
+    m_external_events.pop_front();
+    return event;
   }
 
-  void handle_selection_request_event(xcb_selection_request_event_t* event) {
-    std::lock_guard<std::mutex> lock(m_mutex);
+  bool is_stopped() const {
+    std::lock_guard<std::mutex> lock(m_requests_mutex);
+    return m_stopped;
+  }
 
-    if (event->target == get_atom(TARGETS)) {
-      atoms targets;
-      targets.push_back(get_atom(TARGETS));
-#ifdef CLIP_SUPPORT_SAVE_TARGETS
-      targets.push_back(get_atom(SAVE_TARGETS));
+  bool has_pending_requests() const {
+    std::lock_guard<std::mutex> lock(m_requests_mutex);
+    return !m_pending_requests.empty();
+  }
+
+  // Returns false if the event loop must be stopped.
+  bool handle_event(xcb_generic_event_t* event) {
+    int type = (event->response_type & ~0x80);
+
+    switch (type) {
+
+      case XCB_DESTROY_NOTIFY: {
+        auto destroy = (xcb_destroy_notify_event_t*)event;
+        // To stop the message loop we can just destroy the window
+        if (destroy->window == m_window)
+          return false;
+        // A requestor was destroyed in the middle of an INCR
+        // transfer.
+        else
+          cancel_incr_transfers(destroy->window);
+        break;
+      }
+
+      // Someone else has new content in the clipboard, so is
+      // notifying us that we should delete our data now.
+      case XCB_SELECTION_CLEAR:
+        handle_selection_clear_event(
+          (xcb_selection_clear_event_t*)event);
+        break;
+
+        // Someone is requesting the clipboard content from us.
+      case XCB_SELECTION_REQUEST:
+        handle_selection_request_event(
+          (xcb_selection_request_event_t*)event);
+        break;
+
+        // We've requested the clipboard content and this is the
+        // answer.
+      case XCB_SELECTION_NOTIFY:
+        handle_selection_notify_event(
+          (xcb_selection_notify_event_t*)event);
+        break;
+
+      case XCB_PROPERTY_NOTIFY:
+        handle_property_notify_event(
+          (xcb_property_notify_event_t*)event);
+        break;
+
+        // An error of a request that we didn't check synchronously.
+      case 0:
+        handle_error((xcb_generic_error_t*)event);
+        break;
+
+#ifdef HAVE_XCB_XFIXES_H
+      // The CLIPBOARD owner has changed.
+      default:
+        if (m_xfixes &&
+            type == m_xfixes_event_base + XCB_XFIXES_SELECTION_NOTIFY) {
+          handle_xfixes_selection_notify_event(
+            (xcb_xfixes_selection_notify_event_t*)event);
+        }
+        break;
+#endif
+
+    }
+    return true;
+  }
+
+  void handle_error(xcb_generic_error_t* error) {
+    // We couldn't take the clipboard ownership when a lock was
+    // released (see commit_selection_owner()).
+    if (error->major_code == XCB_SET_SELECTION_OWNER &&
+        error->full_sequence == m_owner_sequence) {
+      ++m_ownership_errors;
+      forget_selection_owner();
+    }
+  }
+
+  void handle_selection_clear_event(xcb_selection_clear_event_t* event) {
+    if (event->selection != get_atom(CLIPBOARD))
+      return;
+
+    // The sequence is checked with the Manager locked, as unlock()
+    // can take the ownership again (and change m_owner_sequence)
+    // while we wait the lock.
+    std::lock_guard<SharedMutex> lock(m_mutex);
+
+    // Ignore the event if it was generated before we took the
+    // ownership again (XCB extends the sequence number of each event
+    // to 32-bit in the "full_sequence" field).
+    const uint32_t sequence = ((xcb_generic_event_t*)event)->full_sequence;
+    if (int32_t(sequence - m_owner_sequence) < 0)
+      return;
+
+    clear_data(); // Clear our clipboard data
+  }
+
+  void handle_selection_request_event(xcb_selection_request_event_t* event) {
+    // We work with a copy of the data (just the pointers to the
+    // buffers), so the Manager is not locked while we send the data
+    // to the requestor.
+    data_map data;
+    {
+      SharedLockGuard lock(m_mutex);
+      data = m_data;
+    }
+
+    // If the data must be encoded first (e.g. an image in image/png
+    // format), we answer the request later, when the encoding
+    // (which is done in other thread) is finished.
+    if (needs_encoding(event, data) && start_encoding()) {
+      m_waiting_encoding.push_back(*event);
+      return;
+    }
+
+    serve_selection_request(event, data);
+  }
+
+  void serve_selection_request(xcb_selection_request_event_t* event,
+                               const data_map& data) {
+
+    if (event->target == get_atom(TARGETS)) {
+      atoms targets;
+      targets.push_back(get_atom(TARGETS));
+#ifdef CLIP_SUPPORT_SAVE_TARGETS
+      targets.push_back(get_atom(SAVE_TARGETS));
       targets.push_back(get_atom(MULTIPLE));
 #endif
-      for (const auto& it : m_data)
+      for (const auto& it : data)
         targets.push_back(it.first);
 
       // Set the "property" of "requestor" with the clipboard
@@ -495,26 +1451,38 @@ private:
                                 get_atom(ATOM_PAIR),
                                 false);
       if (reply) {
+        bool refused = false;
         for (xcb_atom_t
                *ptr=(xcb_atom_t*)xcb_get_property_value(reply),
                *end=ptr + (xcb_get_property_value_length(reply)/sizeof(xcb_atom_t));
-             ptr<end; ) {
-          xcb_atom_t target = *ptr++;
-          xcb_atom_t property = *ptr++;
+             ptr+1<end; ptr+=2) {
+          xcb_atom_t target = ptr[0];
+          xcb_atom_t property = ptr[1];
 
+          // Targets that we cannot convert are reported replacing
+          // its property with None in the ATOM_PAIR list.
           if (!set_requestor_property_with_clipboard_content(
                 event->requestor,
                 property,
-                target)) {
-            xcb_change_property(
-              m_connection,
-              XCB_PROP_MODE_REPLACE,
-              event->requestor,
-              event->property,
-              XCB_ATOM_NONE, 0, 0, nullptr);
+                target,
+                data)) {
+            ptr[1] = XCB_ATOM_NONE;
+            refused = true;
           }
         }
 
+        if (refused) {
+          xcb_change_property(
+            m_connection,
+            XCB_PROP_MODE_REPLACE,
+            event->requestor,
+            event->property,
+            get_atom(ATOM_PAIR),
+            32,
+            xcb_get_property_value_length(reply) / 4,
+            xcb_get_property_value(reply));
+        }
+
         free(reply);
       }
     }
@@ -523,7 +1491,8 @@ private:
       if (!set_requestor_property_with_clipboard_content(
             event->requestor,
             event->property,
-            event->target)) {
+            event->target,
+            data)) {
         // If the requested "target" type is not present in our
         // clipboard, we continue normally sending a SelectionNotify
         // to the "requestor" anyway because some text editors
@@ -558,22 +1527,24 @@ private:
 
   bool set_requestor_property_with_clipboard_content(const xcb_atom_t requestor,
                                                      const xcb_atom_t property,
-                                                     const xcb_atom_t target) {
-    auto it = m_data.find(target);
-    if (it == m_data.end()) {
+                                                     const xcb_atom_t target,
+                                                     const data_map& data) {
+    auto it = data.find(target);
+    if (it == data.end()) {
       // Nothing to do (unsupported target)
       return false;
     }
 
-    // This can be null of the data was set from an image but we
-    // didn't encode the image yet (e.g. to image/png format).
-    if (!it->second) {
-      encode_data_on_demand(*it);
+    // This can be null if the data was set from an image but the
+    // image couldn't be encoded (e.g. to image/png format).
+    if (!it->second)
+      return false;
 
-      // Return nothing, the given "target" cannot be constructed
-      // (maybe by some encoding error).
-      if (!it->second)
-        return false;
+    // If the content doesn't fit in one ChangeProperty request, we
+    // have to send it in chunks using the INCR mechanism.
+    if (it->second->size() > get_max_property_size()) {
+      start_incr_transfer(requestor, property, target, it->second);
+      return true;
     }
 
     // Set the "property" of "requestor" with the
@@ -590,94 +1561,1027 @@ private:
     return true;
   }
 
+  // Starts the INCR mechanism (ICCCM section 2.7.2) to send "data" to
+  // the "requestor". We put a INCR property with the total size, and
+  // then each time the requestor deletes the property (PropertyNotify
+  // with XCB_PROPERTY_DELETE state) we send the next chunk of data.
+  void start_incr_transfer(const xcb_window_t requestor,
+                           const xcb_atom_t property,
+                           const xcb_atom_t target,
+                           const buffer_ptr& data) {
+    // We need the PropertyNotify events of the requestor window to
+    // know when we can send the next chunk, and the DestroyNotify to
+    // cancel the transfer if the requestor is gone. (We already
+    // receive these events for our own window.)
+    if (requestor != m_window &&
+        m_requestor_event_masks.find(requestor) == m_requestor_event_masks.end()) {
+      // With the connection of the application, the application could
+      // be receiving events from the requestor window (e.g. if it's
+      // one of its own windows), so we add our events to them.
+      uint32_t old_mask = XCB_EVENT_MASK_NO_EVENT;
+      if (m_external) {
+        xcb_get_window_attributes_reply_t* attrs =
+          xcb_get_window_attributes_reply(
+            m_connection,
+            xcb_get_window_attributes(m_connection, requestor),
+            nullptr);
+        if (attrs) {
+          old_mask = attrs->your_event_mask;
+          free(attrs);
+        }
+      }
+      m_requestor_event_masks[requestor] = old_mask;
+
+      const uint32_t event_mask =
+        old_mask |
+        XCB_EVENT_MASK_PROPERTY_CHANGE |
+        XCB_EVENT_MASK_STRUCTURE_NOTIFY;
+      xcb_change_window_attributes(m_connection,
+                                   requestor,
+                                   XCB_CW_EVENT_MASK,
+                                   &event_mask);
+    }
+
+    // The INCR property value is a lower bound of the data size, so
+    // we just saturate it if the data is bigger than 4GB.
+    const uint32_t size =
+      uint32_t(std::min<size_t>(data->size(), UINT32_MAX));
+    xcb_change_property(
+      m_connection,
+      XCB_PROP_MODE_REPLACE,
+      requestor,
+      property,
+      get_atom(INCR),
+      32, 1, &size);
+
+    IncrTransfer& transfer = m_incr_transfers[std::make_pair(requestor, property)];
+    transfer.target = target;
+    transfer.data = data;
+    transfer.offset = 0;
+    transfer.deadline = get_inactivity_deadline();
+  }
+
+  // Sends the next chunk of an INCR transfer when the requestor has
+  // deleted the property (i.e. it has read the previous chunk).
+  void handle_incr_transfer_property_delete(xcb_property_notify_event_t* event) {
+    auto it = m_incr_transfers.find(std::make_pair(event->window, event->atom));
+    if (it == m_incr_transfers.end())
+      return;
+
+    IncrTransfer& transfer = it->second;
+    const size_t n = std::min(transfer.data->size() - transfer.offset,
+                              get_max_property_size());
+
+    // A chunk of zero bytes indicates the end of the transfer.
+    xcb_change_property(
+      m_connection,
+      XCB_PROP_MODE_REPLACE,
+      event->window,
+      event->atom,
+      transfer.target,
+      8, n,
+      (n > 0 ? &(*transfer.data)[transfer.offset]: nullptr));
+    transfer.offset += n;
+    transfer.deadline = get_inactivity_deadline();
+
+    if (n == 0) {
+      m_incr_transfers.erase(it);
+      stop_listening_requestor(event->window);
+    }
+
+    xcb_flush(m_connection);
+  }
+
+  void cancel_incr_transfers(const xcb_window_t requestor) {
+    for (auto it=m_incr_transfers.begin(); it!=m_incr_transfers.end(); ) {
+      if (it->first.first == requestor)
+        it = m_incr_transfers.erase(it);
+      else
+        ++it;
+    }
+    // The window was destroyed, there is no event mask to restore.
+    m_requestor_event_masks.erase(requestor);
+  }
+
+  // Drops the INCR transfers whose requestor didn't read the last
+  // chunk in time (e.g. it crashed or it forgot the transfer without
+  // destroying its window), so we don't keep their data forever.
+  void retire_stalled_incr_transfers(const std::chrono::steady_clock::time_point now) {
+    for (auto it=m_incr_transfers.begin(); it!=m_incr_transfers.end(); ) {
+      if (now >= it->second.deadline) {
+        const xcb_window_t requestor = it->first.first;
+        it = m_incr_transfers.erase(it);
+        stop_listening_requestor(requestor);
+      }
+      else
+        ++it;
+    }
+  }
+
+  // Stops receiving events from the given requestor window if there
+  // are no more INCR transfers in progress to it (restoring the
+  // events that we received before the first transfer).
+  void stop_listening_requestor(const xcb_window_t requestor) {
+    for (const auto& it : m_incr_transfers) {
+      if (it.first.first == requestor)
+        return;
+    }
+    auto it = m_requestor_event_masks.find(requestor);
+    if (it == m_requestor_event_masks.end())
+      return;
+
+    const uint32_t event_mask = it->second;
+    m_requestor_event_masks.erase(it);
+    xcb_change_window_attributes(m_connection,
+                                 requestor,
+                                 XCB_CW_EVENT_MASK,
+                                 &event_mask);
+  }
+
+  // Returns the maximum number of bytes of data that we can send in
+  // one ChangeProperty request.
+  size_t get_max_property_size() const {
+    if (!m_max_property_size) {
+      // xcb_get_maximum_request_length() returns the length in 4-byte
+      // units, and it enables the BIG-REQUESTS extension if it's
+      // available (so the limit can be a lot bigger than 256KB).
+      const size_t max_request_bytes =
+        4 * size_t(xcb_get_maximum_request_length(m_connection));
+      after_round_trip();
+
+      // Discount the ChangeProperty request header (plus the extra
+      // length field used by the BIG-REQUESTS extension).
+      const size_t header_bytes = sizeof(xcb_change_property_request_t) + 4;
+
+      m_max_property_size =
+        (max_request_bytes > header_bytes ? max_request_bytes - header_bytes:
+                                            kMinMaxPropertySize);
+    }
+    return m_max_property_size;
+  }
+
+  request_ptr make_request(const atoms& targets,
+                           const xcb_atom_t selection = 0) const {
+    request_ptr req = std::make_shared<Request>();
+    req->selection = (selection ? selection: get_atom(CLIPBOARD));
+    req->targets = targets;
+    return req;
+  }
+
+  // Adds the request to the queue of requests that the background
+  // thread will process.
+  void submit_request(const request_ptr& req) const {
+    const int transfer_timeout = get_x11_transfer_timeout();
+    if (transfer_timeout > 0) {
+      req->end_time =
+        std::min(req->end_time,
+                 std::chrono::steady_clock::now() +
+                 std::chrono::milliseconds(transfer_timeout));
+    }
+    req->end_time = std::min(req->end_time, get_read_deadline());
+    bool stopped;
+    {
+      std::lock_guard<std::mutex> lock(m_requests_mutex);
+      stopped = m_stopped;
+      if (!stopped) {
+        m_pending_requests.push_back(req);
+        wake_up_event_thread();
+      }
+    }
+    if (stopped) {
+      // The background thread is not running
+      complete_request(*req, false);
+    }
+    // In threadless mode we start the request right now (if we are
+    // not processing events already, e.g. when a request is added
+    // from the callback of other request). m_mutex is released as
+    // the events that we process can need it (e.g. SelectionClear or
+    // SelectionRequest events).
+    else if (m_threadless && m_pump_thread != std::this_thread::get_id()) {
+      wait_unlocked(
+        [this]{
+          const_cast<Manager*>(this)->pump_x11_events(0);
+        });
+    }
+  }
+
+  // Waits the given request to be completed by the background thread
+  // (or processing the events in this same thread in threadless
+  // mode).
+  bool wait_request(const request_ptr& req) const {
+    // Nobody else would process the answer if we wait in the thread
+    // that processes the events (e.g. get_text() called from a
+    // watch() callback), so the request fails right now. We use a new
+    // token because the given one could be shared with other
+    // requests.
+    if (is_event_thread()) {
+      if (!req->done) {
+        req->token = cancel_token();
+        req->token.cancel();
+        return false;
+      }
+      return req->result;
+    }
+
+    wait_unlocked(
+      [this, &req]{
+        std::unique_lock<std::mutex> lock(req->mutex);
+        if (!m_threadless) {
+          req->cv.wait(lock, [&req]{ return req->done; });
+          return;
+        }
+        while (!req->done) {
+          lock.unlock();
+          const bool pumped =
+            const_cast<Manager*>(this)->pump_x11_events(kCancelCheckInterval);
+          lock.lock();
+
+          // Wait for the other thread that is processing the events.
+          if (!pumped) {
+            req->cv.wait_for(lock,
+                             std::chrono::milliseconds(kCancelCheckInterval),
+                             [&req]{ return req->done; });
+          }
+        }
+      });
+    return req->result;
+  }
+
+  // Returns true if the current thread is the one that processes the
+  // X11 events: the background thread, or the thread that is pumping
+  // the events in threadless mode.
+  bool is_event_thread() const {
+    const std::thread::id id = std::this_thread::get_id();
+    return (m_thread.get_id() == id || m_pump_thread == id);
+  }
+
+  // Calls the "wait" function releasing m_mutex (the Manager is still
+  // locked for other threads), so the background thread can answer
+  // SelectionRequest events while we wait.
+  void wait_unlocked(const std::function<void()>& wait) const {
+    bool locked, shared = false;
+    {
+      std::lock_guard<std::mutex> lock(m_lock_mutex);
+      auto it = find_lock_holder();
+      locked = (it != m_lock_holders.end());
+      if (locked)
+        shared = it->shared;
+    }
+    if (locked) {
+      if (shared)
+        m_mutex.unlock_shared();
+      else
+        m_mutex.unlock();
+    }
+    wait();
+    if (locked) {
+      if (shared)
+        m_mutex.lock_shared();
+      else
+        m_mutex.lock();
+    }
+  }
+
+  // Returns true if the Manager can be locked now in the given mode
+  // (m_lock_mutex must be locked).
+  bool can_lock(const bool shared) const {
+    return (m_lock_holders.empty() ||
+            (shared && m_lock_holders.front().shared));
+  }
+
+  // Returns the lock of the current thread (m_lock_mutex must be
+  // locked).
+  std::vector<LockHolder>::const_iterator find_lock_holder() const {
+    const std::thread::id id = std::this_thread::get_id();
+    return std::find_if(m_lock_holders.begin(),
+                        m_lock_holders.end(),
+                        [id](const LockHolder& holder) {
+                          return holder.thread == id;
+                        });
+  }
+
+  std::chrono::steady_clock::time_point get_read_deadline() const {
+    std::lock_guard<std::mutex> lock(m_lock_mutex);
+    auto it = find_lock_holder();
+    if (it != m_lock_holders.end())
+      return it->deadline;
+    return std::chrono::steady_clock::time_point::max();
+  }
+
+  bool is_shared_lock() const {
+    std::lock_guard<std::mutex> lock(m_lock_mutex);
+    auto it = find_lock_holder();
+    return (it != m_lock_holders.end() && it->shared);
+  }
+
+  static void complete_request(Request& req, const bool result) {
+    req.result = result;
+    if (req.on_done)
+      req.on_done(req);
+    {
+      std::lock_guard<std::mutex> lock(req.mutex);
+      req.done = true;
+    }
+    req.cv.notify_all();
+  }
+
+  void wake_up_event_thread() const {
+    if (m_wake_pipe[1] >= 0) {
+      const char c = 0;
+      if (write(m_wake_pipe[1], &c, 1) < 0) {
+        // The pipe is full, so the thread will be woken up anyway
+      }
+    }
+  }
+
+  // Must be called after reading a reply in a thread that doesn't
+  // process the events. xcb could have read events from the socket
+  // to its queue while it was waiting the reply, and in that case
+  // poll() will not report them in the X11 file descriptor.
+  void after_round_trip() const {
+    if (m_external)
+      return;
+
+    const std::thread::id id = std::this_thread::get_id();
+    if (m_threadless) {
+      if (m_pump_thread != id)
+        m_queued_events = true;
+    }
+    else if (m_thread.get_id() != id) {
+      wake_up_event_thread();
+    }
+  }
+
+  // In threadless mode, processes the events that xcb could have
+  // queued in a round trip of a user thread (see after_round_trip()),
+  // as the application will not know about them from the X11 file
+  // descriptor. If other thread is processing the events, it will
+  // see the flag when it finishes (see pump_x11_events()). m_mutex
+  // must not be locked by the current thread.
+  void process_queued_events() {
+    if (m_threadless &&
+        m_pump_thread != std::this_thread::get_id() &&
+        m_queued_events) {
+      pump_x11_events(0);
+    }
+  }
+
+  // Starts pending requests and checks the active ones (cancellation
+  // and timeout). Returns the timeout (in milliseconds) to wait for
+  // the next X11 event, or -1 to wait indefinitely.
+  int process_requests() {
+    const auto now = std::chrono::steady_clock::now();
+
+    retire_drained_properties(now);
+    retire_stalled_incr_transfers(now);
+
+    // Iterate a copy as requests are removed when they finish.
+    const std::vector<request_ptr> active = m_active_requests;
+    for (const request_ptr& req : active) {
+      if (req->token.is_cancelled()) {
+        finish_request(*req, false);
+      }
+      else if (now >= req->deadline) {
+        // The selection owner didn't answer in time, so we try the
+        // next target (an INCR transfer cannot be continued with
+        // other target, and there is no more time if we've reached
+        // the end time of the whole request).
+        if (req->incr || now >= req->end_time)
+          finish_request(*req, false);
+        else
+          request_next_target(*req, false);
+      }
+    }
+
+    while (m_active_requests.size() < kMaxActiveRequests) {
+      request_ptr req;
+      {
+        std::lock_guard<std::mutex> lock(m_requests_mutex);
+        if (m_pending_requests.empty())
+          break;
+        req = m_pending_requests.front();
+        m_pending_requests.pop_front();
+      }
+
+      if (req->targets.empty() ||
+          req->token.is_cancelled() ||
+          now >= req->end_time) {
+        complete_request(*req, false);
+        continue;
+      }
+
+      req->property = acquire_property();
+      for (auto& part : req->parts)
+        part.property = acquire_property();
+      m_active_requests.push_back(req);
+      convert_selection(*req);
+    }
+
+    auto deadline = std::chrono::steady_clock::time_point::max();
+    for (const request_ptr& req : m_active_requests)
+      deadline = std::min(deadline, req->deadline);
+    for (const auto& it : m_incr_transfers)
+      deadline = std::min(deadline, it.second.deadline);
+    if (deadline == std::chrono::steady_clock::time_point::max())
+      return -1;
+
+    auto ms =
+      std::chrono::duration_cast<std::chrono::milliseconds>(
+        deadline - std::chrono::steady_clock::now()).count() + 1;
+
+    // The background thread is woken up when a request is cancelled,
+    // but in threadless mode nobody waits for the wake pipe.
+    if (m_threadless)
+      ms = std::min<decltype(ms)>(ms, kCancelCheckInterval);
+    return int(std::max<decltype(ms)>(
+                 0, std::min<decltype(ms)>(ms, std::numeric_limits<int>::max())));
+  }
+
+  // Fails all the requests when the background thread is stopped.
+  void stop_requests() {
+    std::deque<request_ptr> pending;
+    {
+      std::lock_guard<std::mutex> lock(m_requests_mutex);
+      m_stopped = true;
+      pending.swap(m_pending_requests);
+    }
+    while (!m_active_requests.empty())
+      finish_request(*m_active_requests.front(), false);
+    for (auto& req : pending)
+      complete_request(*req, false);
+  }
+
+  // Returns a property of our window to receive the data of a new
+  // request. The "CLIP_PROP_n" atoms are interned the first time they
+  // are needed and then reused.
+  xcb_atom_t acquire_property() {
+    if (m_free_properties.empty()) {
+      const std::string name =
+        "CLIP_PROP_" + std::to_string(m_properties_count++);
+      const xcb_atom_t property = get_atom(name.c_str());
+
+      std::lock_guard<std::mutex> lock(m_atoms_mutex);
+      m_all_properties.push_back(property);
+      return property;
+    }
+    const xcb_atom_t property = m_free_properties.back();
+    m_free_properties.pop_back();
+    return property;
+  }
+
+  // Returns true if it's one of the "CLIP_PROP_n" properties.
+  bool is_our_property(const xcb_atom_t property) const {
+    if (property == XCB_ATOM_NONE)
+      return false;
+
+    std::lock_guard<std::mutex> lock(m_atoms_mutex);
+    return (std::find(m_all_properties.begin(),
+                      m_all_properties.end(),
+                      property) != m_all_properties.end());
+  }
+
+  // Returns the property to the pool of free properties. If the
+  // owner is still sending data to it ("incr_in_progress"), it's not
+  // reused until we receive the last chunk (see drain_property()), in
+  // other case the old chunks could be mixed with the data of the
+  // next request.
+  void release_property(const xcb_atom_t property,
+                        const bool incr_in_progress = false) {
+    if (!property)
+      return;
+
+    // Discard any data that the owner could have left in the property
+    // (e.g. if the request was cancelled).
+    xcb_delete_property(m_connection, m_window, property);
+    xcb_flush(m_connection);
+
+    if (incr_in_progress)
+      m_draining_properties[property] = get_inactivity_deadline();
+    else
+      m_free_properties.push_back(property);
+  }
+
+  // Returns when an INCR transfer (that we receive or send) is
+  // abandoned if there is no activity (a new chunk) until then.
+  std::chrono::steady_clock::time_point get_inactivity_deadline() const {
+    return std::chrono::steady_clock::now() +
+      std::chrono::milliseconds(get_x11_wait_timeout());
+  }
+
+  // Discards the chunks of an abandoned INCR transfer. Returns false
+  // if the property is not being drained.
+  bool drain_property(const xcb_atom_t property) {
+    auto it = m_draining_properties.find(property);
+    if (it == m_draining_properties.end())
+      return false;
+
+    // Asking for zero bytes we know if it's the last (empty) chunk.
+    xcb_get_property_reply_t* reply =
+      get_and_delete_property(m_window,
+                              property,
+                              XCB_GET_PROPERTY_TYPE_ANY,
+                              false, 0, 0);
+    const bool last = (reply && reply->bytes_after == 0);
+    free(reply);
+
+    // Deleting the property the owner sends the next chunk.
+    xcb_delete_property(m_connection, m_window, property);
+    xcb_flush(m_connection);
+
+    if (last) {
+      m_draining_properties.erase(it);
+      m_free_properties.push_back(property);
+    }
+    else {
+      it->second = get_inactivity_deadline();
+    }
+    return true;
+  }
+
+  // Forgets the properties where the owner stopped sending chunks
+  // without the last one, they are never used again.
+  void retire_drained_properties(const std::chrono::steady_clock::time_point now) {
+    for (auto it=m_draining_properties.begin(); it!=m_draining_properties.end(); ) {
+      if (now >= it->second)
+        it = m_draining_properties.erase(it);
+      else
+        ++it;
+    }
+  }
+
+  // Asks the selection owner to convert the selection to the current
+  // target of the request.
+  void convert_selection(Request& req) {
+    req.incr = false;
+    req.data.clear();
+
+    // The list of target/property pairs for the MULTIPLE conversion
+    // is given in the request property.
+    if (req.mode == Request::Multiple) {
+      atoms pairs;
+      for (auto& part : req.parts) {
+        part.incr = part.done = part.ok = false;
+        part.data.clear();
+        pairs.push_back(part.target);
+        pairs.push_back(part.property);
+      }
+      xcb_change_property(m_connection,
+                          XCB_PROP_MODE_REPLACE,
+                          m_window,
+                          req.property,
+                          get_atom(ATOM_PAIR),
+                          32, pairs.size(), &pairs[0]);
+    }
+
+    xcb_convert_selection(m_connection,
+                          m_window, // Send us the result
+                          req.selection, // Clipboard selection
+                          req.targets[req.target_index], // The clipboard format that we're requesting
+                          req.property, // Leave result in this window's property
+                          XCB_CURRENT_TIME);
+    xcb_flush(m_connection);
+
+    reset_request_deadline(req);
+  }
+
+  void reset_request_deadline(Request& req) {
+    req.sent = std::chrono::steady_clock::now();
+    req.deadline = std::min(req.sent + get_owner_timeout(req.owner),
+                            req.end_time);
+  }
+
+  // Returns the time to wait for an answer of the given selection
+  // owner.
+  std::chrono::milliseconds get_owner_timeout(const xcb_window_t owner) const {
+    const int timeout = get_x11_wait_timeout();
+    if (owner && get_x11_adaptive_timeout()) {
+      auto it = m_owner_latencies.find(owner);
+      if (it != m_owner_latencies.end()) {
+        const OwnerLatency& latency = it->second;
+        const int adaptive = int(latency.average + 4*latency.variation);
+        return std::chrono::milliseconds(
+          std::min(timeout, std::max(kMinAdaptiveTimeout, adaptive)));
+      }
+    }
+    return std::chrono::milliseconds(timeout);
+  }
+
+  // Updates the latency of the selection owner with the time it took
+  // to answer the request. We use the same smoothed average/variation
+  // used to calculate the TCP retransmission timeout (RFC 6298).
+  void update_owner_latency(const Request& req) {
+    if (!req.owner)
+      return;
+
+    const double sample =
+      std::chrono::duration<double, std::milli>(
+        std::chrono::steady_clock::now() - req.sent).count();
+
+    auto it = m_owner_latencies.find(req.owner);
+    if (it == m_owner_latencies.end()) {
+      if (m_owner_latencies.size() >= kMaxOwnerLatencies)
+        m_owner_latencies.clear();
+      m_owner_latencies[req.owner] = OwnerLatency{ sample, sample/2 };
+    }
+    else {
+      OwnerLatency& latency = it->second;
+      latency.variation = 0.75*latency.variation + 0.25*std::fabs(latency.average - sample);
+      latency.average = 0.875*latency.average + 0.125*sample;
+    }
+  }
+
+  // Asks for the next target of the request. If "refused" is true
+  // the owner answered that it cannot convert the current target
+  // (a late answer or an error doesn't mean that the target is not
+  // supported, so it's not added to the negative cache).
+  void request_next_target(Request& req, const bool refused) {
+    if (refused)
+      req.refused.push_back(req.targets[req.target_index]);
+    if (++req.target_index < req.targets.size())
+      convert_selection(req);
+    else
+      finish_request(req, false);
+  }
+
+  // Removes the request from the list of active requests and
+  // completes it.
+  void finish_request(Request& req, const bool result) {
+    auto it = std::find_if(m_active_requests.begin(),
+                           m_active_requests.end(),
+                           [&req](const request_ptr& r) {
+                             return r.get() == &req;
+                           });
+    assert(it != m_active_requests.end());
+    if (it == m_active_requests.end())
+      return;
+
+    // Keep the request alive until it's completed.
+    request_ptr ptr = *it;
+    m_active_requests.erase(it);
+
+    // An INCR transfer still in progress was abandoned (the request
+    // was cancelled or it failed).
+    release_property(req.property,
+                     req.mode != Request::Multiple && req.incr);
+    req.property = 0;
+    for (auto& part : req.parts) {
+      release_property(part.property, part.incr && !part.done);
+      part.property = 0;
+    }
+    complete_request(req, result);
+  }
+
+  // Returns the active request that receives its data in the given
+  // property of our window (and the MULTIPLE part in "part_out" if
+  // the property is one of the parts).
+  Request* find_request_by_property(const xcb_atom_t property,
+                                    Request::Part** part_out = nullptr) const {
+    for (const request_ptr& req : m_active_requests) {
+      if (req->property == property)
+        return req.get();
+      for (auto& part : req->parts) {
+        if (part.property == property) {
+          if (part_out)
+            *part_out = &part;
+          return req.get();
+        }
+      }
+    }
+    return nullptr;
+  }
+
   void handle_selection_notify_event(xcb_selection_notify_event_t* event) {
     assert(event->requestor == m_window);
 
-    if (event->target == get_atom(TARGETS))
-      m_target_atom = get_atom(ATOM);
-    else
-      m_target_atom = event->target;
+    // The selection owner cannot convert the selection to the
+    // requested target, so we can try the next one right now. As the
+    // property is not reported, we assume that the refused request is
+    // the oldest one asking for this selection/target.
+    if (event->property == XCB_ATOM_NONE) {
+      for (const request_ptr& req : m_active_requests) {
+        if (!req->incr &&
+            req->selection == event->selection &&
+            req->targets[req->target_index] == event->target) {
+          update_owner_latency(*req);
+          request_next_target(*req, true);
+          break;
+        }
+      }
+      return;
+    }
+
+    Request* found = find_request_by_property(event->property);
+    if (!found)
+      return;
+
+    Request& req = *found;
+    if (req.incr ||
+        event->selection != req.selection ||
+        event->target != req.targets[req.target_index])
+      return;
+
+    update_owner_latency(req);
+
+#ifdef CLIP_SUPPORT_SAVE_TARGETS
+    // The clipboard manager has saved our content (the property
+    // doesn't contain data, it's just the confirmation).
+    if (event->target == get_atom(SAVE_TARGETS)) {
+      xcb_delete_property(m_connection, m_window, event->property);
+      xcb_flush(m_connection);
+      finish_request(req, true);
+      return;
+    }
+#endif
+
+    if (req.mode == Request::LengthOnly) {
+      handle_length_only_reply(req, event);
+      return;
+    }
+    else if (req.mode == Request::Multiple) {
+      handle_multiple_reply(req, event);
+      return;
+    }
 
     xcb_get_property_reply_t* reply =
       get_and_delete_property(event->requestor,
                               event->property,
-                              m_target_atom);
-    if (reply) {
-      // In this case, We're going to receive the clipboard content in
-      // chunks of data with several PropertyNotify events.
-      if (reply->type == get_atom(INCR)) {
-        free(reply);
+                              XCB_GET_PROPERTY_TYPE_ANY);
+    if (!reply || reply->type == XCB_ATOM_NONE) {
+      request_next_target(req, reply != nullptr);
+      free(reply);
+      return;
+    }
 
-        reply = get_and_delete_property(event->requestor,
-                                        event->property,
-                                        get_atom(INCR));
-        if (reply) {
-          if (xcb_get_property_value_length(reply) == 4) {
-            uint32_t n = *(uint32_t*)xcb_get_property_value(reply);
-            m_reply_data = std::make_shared<std::vector<uint8_t>>(n);
-            m_reply_offset = 0;
-            m_incr_process = true;
-            m_incr_received = true;
-          }
-          free(reply);
-        }
+    // In this case, We're going to receive the clipboard content in
+    // chunks of data with several PropertyNotify events. The INCR
+    // property was already deleted, so the owner will start sending
+    // the data. The total size (a lower bound) is not needed because
+    // each chunk is kept in its own segment.
+    if (reply->type == get_atom(INCR)) {
+      const size_t size =
+        (xcb_get_property_value_length(reply) == 4 ?
+         *(uint32_t*)xcb_get_property_value(reply): 0);
+      free(reply);
+
+      req.incr = true;
+      if (req.max_size && size > req.max_size) {
+        finish_request(req, false);
+        return;
+      }
+
+      reset_request_deadline(req);
+    }
+    else if (req.max_size &&
+             xcb_get_property_value_length(reply) + reply->bytes_after > req.max_size) {
+      free(reply);
+      finish_request(req, false);
+    }
+    else {
+      // Simple case, the whole clipboard content in just one reply
+      // (without the INCR method).
+      read_property_slices(req,
+                           req.data,
+                           event->requestor,
+                           event->property,
+                           reply);
+      finish_request(req, true);
+    }
+  }
+
+  // Reads the data of each part of a MULTIPLE conversion. The owner
+  // replaces the property of the targets that cannot be converted
+  // with None in the ATOM_PAIR list.
+  void handle_multiple_reply(Request& req,
+                             xcb_selection_notify_event_t* event) {
+    xcb_get_property_reply_t* reply =
+      get_and_delete_property(event->requestor,
+                              event->property,
+                              get_atom(ATOM_PAIR));
+    if (!reply) {
+      finish_request(req, false);
+      return;
+    }
+
+    const xcb_atom_t* pairs = (const xcb_atom_t*)xcb_get_property_value(reply);
+    const size_t npairs = xcb_get_property_value_length(reply) / (2*sizeof(xcb_atom_t));
+
+    for (size_t i=0; i<req.parts.size(); ++i) {
+      Request::Part& part = req.parts[i];
+      if (i >= npairs || pairs[2*i+1] == XCB_ATOM_NONE) {
+        part.done = true;
+        continue;
+      }
+
+      xcb_get_property_reply_t* part_reply =
+        get_and_delete_property(event->requestor,
+                                part.property,
+                                XCB_GET_PROPERTY_TYPE_ANY);
+      if (!part_reply || part_reply->type == XCB_ATOM_NONE) {
+        free(part_reply);
+        part.done = true;
+      }
+      // This part will be received in chunks with PropertyNotify
+      // events (the INCR property was already deleted).
+      else if (part_reply->type == get_atom(INCR)) {
+        free(part_reply);
+        part.incr = true;
       }
       else {
-        // Simple case, the whole clipboard content in just one reply
-        // (without the INCR method).
-        m_reply_data.reset();
-        m_reply_offset = 0;
-        copy_reply_data(reply);
+        read_property_slices(req,
+                             part.data,
+                             event->requestor,
+                             part.property,
+                             part_reply);
+        part.ok = part.done = true;
+      }
+    }
+    free(reply);
+
+    if (all_parts_done(req)) {
+      finish_request(req, true);
+    }
+    else {
+      req.incr = true;
+      reset_request_deadline(req);
+    }
+  }
+
+  static bool all_parts_done(const Request& req) {
+    for (const auto& part : req.parts) {
+      if (!part.done)
+        return false;
+    }
+    return true;
+  }
 
-        call_callback(reply);
+  // Gets the size of the data that the selection owner put in the
+  // property without transferring the data itself.
+  void handle_length_only_reply(Request& req,
+                                xcb_selection_notify_event_t* event) {
+    // Asking for zero bytes of the property value we get the total
+    // size of the value in "bytes_after".
+    xcb_get_property_reply_t* reply =
+      get_and_delete_property(event->requestor,
+                              event->property,
+                              XCB_GET_PROPERTY_TYPE_ANY,
+                              false, 0, 0);
+    if (!reply) {
+      request_next_target(req, false);
+      return;
+    }
 
+    req.length = 0;
+    if (reply->type == get_atom(INCR)) {
+      free(reply);
+
+      // The INCR property contains a lower bound of the data size.
+      // Deleting the property the owner starts sending the data, so
+      // we keep receiving it for the next get_data() (see
+      // continue_incr_transfer()).
+      reply = get_and_delete_property(event->requestor,
+                                      event->property,
+                                      get_atom(INCR));
+      if (reply) {
+        if (xcb_get_property_value_length(reply) == 4)
+          req.length = *(uint32_t*)xcb_get_property_value(reply);
         free(reply);
       }
+
+      continue_incr_transfer(req);
+    }
+    else {
+      req.length = reply->bytes_after;
+      free(reply);
+
+      xcb_delete_property(m_connection,
+                          event->requestor,
+                          event->property);
+      xcb_flush(m_connection);
     }
+
+    finish_request(req, true);
+  }
+
+  // Continues the INCR transfer started by a length-only request as
+  // a new data request that receives the chunks in the same property.
+  // Other threads can wait for it as an in-flight read, and the data
+  // is added to the transfer cache when it's completed.
+  void continue_incr_transfer(Request& req) {
+    request_ptr data_req = std::make_shared<Request>();
+    data_req->selection = req.selection;
+    data_req->targets.assign(req.targets.begin() + req.target_index,
+                             req.targets.end());
+    data_req->property = req.property;
+    data_req->incr = true;
+    data_req->end_time = req.end_time;
+    data_req->owner = req.owner;
+    data_req->serial = req.serial;
+    reset_request_deadline(*data_req);
+
+    // The property belongs to the new request now.
+    req.property = 0;
+
+    in_flight_read_ptr read;
+    if (req.selection == get_atom(CLIPBOARD))
+      read = add_in_flight_read(req.owner, req.serial, data_req);
+
+    data_req->on_done = [this, read](Request& r) {
+      reply_buffer_ptr data;
+      if (r.result && r.selection == get_atom(CLIPBOARD)) {
+        data = std::make_shared<ReplyBuffer>();
+        data->swap(r.data);
+        add_cached_transfer(r.owner, r.serial,
+                            r.targets[r.target_index], data);
+      }
+      if (read)
+        finish_in_flight_read(read, r.result, data);
+    };
+
+    m_active_requests.push_back(data_req);
   }
 
   void handle_property_notify_event(xcb_property_notify_event_t* event) {
-    if (m_incr_process &&
-        event->state == XCB_PROPERTY_NEW_VALUE &&
-        event->atom == get_atom(CLIPBOARD)) {
-      xcb_get_property_reply_t* reply =
-        get_and_delete_property(event->window,
-                                event->atom,
-                                m_target_atom);
-      if (reply) {
-        m_incr_received = true;
+    // Some requestor has read a chunk of data that we are sending
+    // with the INCR method (the requestor can be our own window when
+    // we ask for our own data asynchronously).
+    if (event->state == XCB_PROPERTY_DELETE) {
+      handle_incr_transfer_property_delete(event);
+      return;
+    }
 
-        // When the length is 0 it means that the content was
-        // completely sent by the selection owner.
-        if (xcb_get_property_value_length(reply) > 0) {
-          copy_reply_data(reply);
-        }
-        else {
-          // Now that m_reply_data has the complete clipboard content,
-          // we can call the m_callback.
-          call_callback(reply);
-          m_incr_process = false;
-        }
-        free(reply);
+    if (event->window != m_window ||
+        event->state != XCB_PROPERTY_NEW_VALUE)
+      return;
+
+    if (drain_property(event->atom))
+      return;
+
+    Request::Part* part = nullptr;
+    Request* found = find_request_by_property(event->atom, &part);
+    if (!found || !found->incr || (part && (!part->incr || part->done)))
+      return;
+
+    Request& req = *found;
+    xcb_get_property_reply_t* reply =
+      get_and_delete_property(event->window,
+                              event->atom,
+                              XCB_GET_PROPERTY_TYPE_ANY);
+    if (!reply)
+      return;
+
+    // Wait more time as we're still receiving data.
+    update_owner_latency(req);
+    reset_request_deadline(req);
+
+    // When the length is 0 it means that the content was
+    // completely sent by the selection owner.
+    if (xcb_get_property_value_length(reply) > 0) {
+      read_property_slices(req,
+                           (part ? part->data: req.data),
+                           event->window,
+                           event->atom,
+                           reply);
+
+      if (req.max_size && req.data.size() > req.max_size)
+        finish_request(req, false);
+    }
+    else {
+      free(reply);
+      if (part) {
+        part->ok = part->done = true;
+        if (all_parts_done(req))
+          finish_request(req, true);
+      }
+      else {
+        // The transfer is completed.
+        req.incr = false;
+        finish_request(req, true);
       }
     }
   }
 
+  // Gets "length" 32-bit units of the "property" value starting at
+  // "offset" (also in 32-bit units). If "delete_prop" is true, the
+  // property is deleted by the server after reading its last slice
+  // (i.e. when bytes_after is 0).
   xcb_get_property_reply_t* get_and_delete_property(xcb_window_t window,
                                                     xcb_atom_t property,
                                                     xcb_atom_t atom,
-                                                    bool delete_prop = true) {
+                                                    bool delete_prop = true,
+                                                    uint32_t offset = 0,
+                                                    uint32_t length = kPropertySliceLength) {
     xcb_get_property_cookie_t cookie =
       xcb_get_property(m_connection,
                        delete_prop,
                        window,
                        property,
                        atom,
-                       0, 0x1fffffff); // 0x1fffffff = INT32_MAX / 4
+                       offset, length);
 
     xcb_generic_error_t* err = nullptr;
     xcb_get_property_reply_t* reply =
       xcb_get_property_reply(m_connection, cookie, &err);
+    after_round_trip();
     if (err) {
       // TODO report error
       free(err);
@@ -685,175 +2589,356 @@ private:
     return reply;
   }
 
-  // Concatenates the new data received in "reply" into "m_reply_data"
-  // buffer.
-  void copy_reply_data(xcb_get_property_reply_t* reply) {
-    const uint8_t* src = (const uint8_t*)xcb_get_property_value(reply);
-    // n = length of "src" in bytes
-    size_t n = xcb_get_property_value_length(reply);
+  // Keeps the first slice of the property value ("reply") and then
+  // reads the remaining slices (if any) so we never ask for the
+  // whole property value in just one reply. Takes the ownership of
+  // "reply".
+  void read_property_slices(Request& req,
+                            ReplyBuffer& data,
+                            xcb_window_t window,
+                            xcb_atom_t property,
+                            xcb_get_property_reply_t* reply) {
+    uint32_t offset = xcb_get_property_value_length(reply) / 4;
+    uint32_t bytes_after = reply->bytes_after;
+    add_reply_data(req, data, reply);
+
+    while (bytes_after > 0) {
+      xcb_get_property_reply_t* slice =
+        get_and_delete_property(window, property,
+                                XCB_GET_PROPERTY_TYPE_ANY,
+                                true, offset);
+      if (!slice)
+        break;
+
+      const int n = xcb_get_property_value_length(slice);
+      offset += n / 4;
+      bytes_after = (n > 0 ? slice->bytes_after: 0);
+      add_reply_data(req, data, slice);
+    }
+  }
 
-    size_t req = m_reply_offset+n;
-    if (!m_reply_data) {
-      m_reply_data = std::make_shared<std::vector<uint8_t>>(req);
+  // Adds the new data received in "reply" as a new segment of "data"
+  // (or sends it to the request stream callback). Takes the ownership
+  // of "reply".
+  void add_reply_data(Request& req,
+                      ReplyBuffer& data,
+                      xcb_get_property_reply_t* reply) {
+    if (req.stream) {
+      bool keep_data;
+      {
+        std::lock_guard<std::mutex> lock(req.mutex);
+        req.streamed = true;
+        keep_data = req.keep_data;
+      }
+
+      const int n = xcb_get_property_value_length(reply);
+      if (n > 0)
+        req.stream((const char*)xcb_get_property_value(reply), n);
+
+      if (keep_data)
+        data.append(reply);
+      else
+        free(reply);
+      return;
     }
-    // The "m_reply_data" size can be smaller because the size
-    // specified in INCR property is just a lower bound.
-    else if (req > m_reply_data->size()) {
-      m_reply_data->resize(req);
+
+    data.append(reply);
+  }
+
+  // Asks the selection owner for the content of the request and waits
+  // the answer. The "callback" is called in this same thread to
+  // process the received data.
+  bool get_data_from_selection_owner(const request_ptr& req,
+                                     const notify_callback& callback) const {
+    const size_t serial = get_selection_serial();
+    const xcb_window_t owner = get_x11_selection_owner();
+
+    // Check if we've already received the data in one of the given
+    // formats from the same CLIPBOARD owner (length-only queries
+    // don't transfer data, so they are not cached).
+    const bool use_cache = (req->selection == get_atom(CLIPBOARD) &&
+                            req->mode == Request::Data);
+    if (use_cache) {
+      if (reply_buffer_ptr data = find_cached_transfer(owner, req->targets)) {
+        ++m_transfer_cache_hits;
+        if (req->stream) {
+          for (const auto& seg : data->segments())
+            req->stream((const char*)seg.data, seg.size);
+        }
+        return callback(*data);
+      }
+      ++m_transfer_cache_misses;
+    }
+
+    // We cannot wait for the selection owner in the thread that
+    // processes the events (see wait_request()).
+    if (is_event_thread())
+      return false;
+
+    // Ask only for the supported targets, so we don't have to wait a
+    // timeout for each unsupported target.
+    if (req->selection == get_atom(CLIPBOARD) &&
+        req->mode != Request::Multiple &&
+        req->targets.size() > 1) {
+      select_supported_targets(owner, req->targets);
+      if (req->targets.empty())
+        return false;
+    }
+
+    // If other thread is receiving the same data right now, we just
+    // wait for its result.
+    in_flight_read_ptr read;
+    if (use_cache && !req->max_size) {
+      read = join_in_flight_read(owner, serial, req->targets);
+      if (read) {
+        const auto deadline = get_read_deadline();
+        bool done = false;
+        wait_unlocked(
+          [&read, &deadline, &done]{
+            std::unique_lock<std::mutex> lock(read->mutex);
+            done = read->cv.wait_until(lock, deadline,
+                                       [&read]{ return read->done; });
+          });
+        if (!done || !read->result || !read->data)
+          return false;
+
+        ++m_coalesced_reads;
+        if (req->stream) {
+          for (const auto& seg : read->data->segments())
+            req->stream((const char*)seg.data, seg.size);
+        }
+        return callback(*read->data);
+      }
+      read = add_in_flight_read(owner, serial, req);
     }
 
-    std::copy(src, src+n, m_reply_data->begin()+m_reply_offset);
-    m_reply_offset += n;
-  }
+    req->owner = owner;
+    req->serial = serial;
+    submit_request(req);
+    const bool result = wait_request(req);
+
+    if (req->selection == get_atom(CLIPBOARD) && !req->refused.empty())
+      add_refused_targets(owner, req->refused);
+
+    // As the request is completed, we can access "keep_data" without
+    // locking its mutex.
+    reply_buffer_ptr data;
+    if (result && use_cache && (!req->stream || req->keep_data)) {
+      data = std::make_shared<ReplyBuffer>();
+      data->swap(req->data);
+      add_cached_transfer(owner, serial, req->targets[req->target_index], data);
+    }
 
-  // Calls the current m_callback() to handle the clipboard content
-  // received from the owner.
-  void call_callback(xcb_get_property_reply_t* reply) {
-    m_callback_result = false;
-    if (m_callback)
-      m_callback_result = m_callback();
+    if (read)
+      finish_in_flight_read(read, result, data);
 
-    m_cv.notify_one();
+    if (!result)
+      return false;
 
-    m_reply_data.reset();
+    return callback(data ? *data: req->data);
   }
 
-  bool get_data_from_selection_owner(const atoms& atoms,
-                                     const notify_callback&& callback,
-                                     xcb_atom_t selection = 0) const {
-    if (!selection)
-      selection = get_atom(CLIPBOARD);
-
-    // Put the callback on "m_callback" so we can call it on
-    // SelectionNotify event.
-    m_callback = std::move(callback);
-
-    // Clear data if we are not the selection owner.
-    if (m_window != get_x11_selection_owner())
-      m_data.clear();
+  // Returns the request in progress to get the same data, or nullptr
+  // if there is no one (or if it's a "stream" request that has
+  // already given part of the data to its callback).
+  in_flight_read_ptr join_in_flight_read(const xcb_window_t owner,
+                                         const size_t serial,
+                                         const atoms& targets) const {
+    std::lock_guard<std::mutex> lock(m_in_flight_mutex);
+    for (const in_flight_read_ptr& read : m_in_flight_reads) {
+      if (read->owner != owner ||
+          read->serial != serial ||
+          read->targets != targets)
+        continue;
+
+      Request& req = *read->req;
+      if (req.stream) {
+        std::lock_guard<std::mutex> lock(req.mutex);
+        if (req.streamed)
+          continue;
+        req.keep_data = true;
+      }
+      return read;
+    }
+    return nullptr;
+  }
 
-    // Ask to the selection owner for its content on each known
-    // text format/atom.
-    for (xcb_atom_t atom : atoms) {
-      xcb_convert_selection(m_connection,
-                            m_window, // Send us the result
-                            selection, // Clipboard selection
-                            atom, // The clipboard format that we're requesting
-                            get_atom(CLIPBOARD), // Leave result in this window's property
-                            XCB_CURRENT_TIME);
+  in_flight_read_ptr add_in_flight_read(const xcb_window_t owner,
+                                        const size_t serial,
+                                        const request_ptr& req) const {
+    in_flight_read_ptr read = std::make_shared<InFlightRead>();
+    read->owner = owner;
+    read->serial = serial;
+    read->targets = req->targets;
+    read->req = req;
+
+    std::lock_guard<std::mutex> lock(m_in_flight_mutex);
+    m_in_flight_reads.push_back(read);
+    return read;
+  }
 
-      xcb_flush(m_connection);
+  // Gives the result of the request to the threads waiting for it.
+  void finish_in_flight_read(const in_flight_read_ptr& read,
+                             const bool result,
+                             const reply_buffer_ptr& data) const {
+    {
+      std::lock_guard<std::mutex> lock(m_in_flight_mutex);
+      m_in_flight_reads.erase(std::find(m_in_flight_reads.begin(),
+                                        m_in_flight_reads.end(),
+                                        read));
+    }
+    {
+      std::lock_guard<std::mutex> lock(read->mutex);
+      read->done = true;
+      read->result = result;
+      read->data = data;
+    }
+    read->cv.notify_all();
+  }
 
-      // We use the "m_incr_received" to wait several timeouts in case
-      // that we've received the INCR SelectionNotify or
-      // PropertyNotify events.
-      do {
-        m_incr_received = false;
-
-        // Wait a response for 100 milliseconds
-        std::cv_status status =
-          m_cv.wait_for(m_lock,
-                        std::chrono::milliseconds(get_x11_wait_timeout()));
-        if (status == std::cv_status::no_timeout) {
-          // If the condition variable was notified, it means that the
-          // callback was called correctly.
-          return m_callback_result;
+  // Returns the data received from the given "owner" in the first
+  // format of "targets" that we have in the cache (if it's still
+  // valid, i.e. the selection didn't change since we received it).
+  reply_buffer_ptr find_cached_transfer(const xcb_window_t owner,
+                                        const atoms& targets) const {
+    std::lock_guard<std::mutex> lock(m_transfer_cache_mutex);
+    for (xcb_atom_t target : targets) {
+      for (const CachedTransfer& entry : m_transfer_cache) {
+        if (entry.owner == owner &&
+            entry.serial == get_selection_serial() &&
+            entry.target == target) {
+          return entry.data;
         }
-      } while (m_incr_received);
+      }
     }
+    return nullptr;
+  }
 
-    // Reset callback
-    m_callback = notify_callback();
-    return false;
+  // Adds the data received from the "owner" to the cache. "serial"
+  // is the selection serial when we asked for the data, so if the
+  // selection changed in the meantime, the data is not added.
+  void add_cached_transfer(const xcb_window_t owner,
+                           const size_t serial,
+                           const xcb_atom_t target,
+                           const reply_buffer_ptr& data) const {
+    if (!data || serial != get_selection_serial())
+      return;
+
+    std::lock_guard<std::mutex> lock(m_transfer_cache_mutex);
+
+    // Remove data from other owners/selections
+    m_transfer_cache.erase(
+      std::remove_if(m_transfer_cache.begin(),
+                     m_transfer_cache.end(),
+                     [owner, serial](const CachedTransfer& entry) {
+                       return (entry.owner != owner ||
+                               entry.serial != serial);
+                     }),
+      m_transfer_cache.end());
+
+    if (m_transfer_cache.size() >= kMaxCachedTransfers)
+      m_transfer_cache.erase(m_transfer_cache.begin());
+
+    CachedTransfer entry;
+    entry.owner = owner;
+    entry.serial = serial;
+    entry.target = target;
+    entry.data = data;
+    m_transfer_cache.push_back(entry);
   }
 
+  // Returns the atoms of the given names. The atoms that are not in
+  // the cache are interned in just one round trip (we don't wait each
+  // reply before sending the next request).
   atoms get_atoms(const char** names,
                   const int n) const {
     atoms result(n, 0);
     std::vector<xcb_intern_atom_cookie_t> cookies(n);
 
+    {
+      std::lock_guard<std::mutex> lock(m_atoms_mutex);
+      for (int i=0; i<n; ++i) {
+        auto it = m_atoms.find(names[i]);
+        if (it != m_atoms.end())
+          result[i] = it->second;
+      }
+    }
+
+    // The atoms are interned without locking the cache, so other
+    // threads can use it in the meantime.
     for (int i=0; i<n; ++i) {
-      auto it = m_atoms.find(names[i]);
-      if (it != m_atoms.end())
-        result[i] = it->second;
-      else
+      if (result[i] == 0)
         cookies[i] = xcb_intern_atom(
           m_connection, 0,
           std::strlen(names[i]), names[i]);
     }
 
+    bool round_trip = false;
     for (int i=0; i<n; ++i) {
       if (result[i] == 0) {
         xcb_intern_atom_reply_t* reply =
           xcb_intern_atom_reply(m_connection,
                                 cookies[i],
                                 nullptr);
+        round_trip = true;
         if (reply) {
-          result[i] = m_atoms[names[i]] = reply->atom;
+          result[i] = reply->atom;
           free(reply);
+
+          std::lock_guard<std::mutex> lock(m_atoms_mutex);
+          m_atoms[names[i]] = result[i];
         }
       }
     }
+    if (round_trip)
+      after_round_trip();
 
     return result;
   }
 
   xcb_atom_t get_atom(const char* name) const {
-    auto it = m_atoms.find(name);
-    if (it != m_atoms.end())
-      return it->second;
-
-    xcb_atom_t result = 0;
-    xcb_intern_atom_cookie_t cookie =
-      xcb_intern_atom(m_connection, 0,
-                      std::strlen(name), name);
-
-    xcb_intern_atom_reply_t* reply =
-      xcb_intern_atom_reply(m_connection,
-                            cookie,
-                            nullptr);
-    if (reply) {
-      result = m_atoms[name] = reply->atom;
-      free(reply);
-    }
-    return result;
+    return get_atoms(&name, 1)[0];
   }
 
   xcb_atom_t get_atom(CommonAtom i) const {
-    if (m_common_atoms.empty()) {
-      m_common_atoms =
-        get_atoms(kCommonAtomNames,
-                  sizeof(kCommonAtomNames) / sizeof(kCommonAtomNames[0]));
-    }
+    assert(size_t(i) < m_common_atoms.size());
     return m_common_atoms[i];
   }
 
+  void init_atoms() {
+    const char* text_names[] = {
+      // Prefer utf-8 formats first
+      "UTF8_STRING",
+      "text/plain;charset=utf-8",
+      "text/plain;charset=UTF-8",
+      "GTK_TEXT_BUFFER_CONTENTS", // Required for gedit (and maybe gtk+ apps)
+      // ANSI C strings?
+      "STRING",
+      "TEXT",
+      "text/plain",
+    };
+    const size_t ncommon = sizeof(kCommonAtomNames) / sizeof(kCommonAtomNames[0]);
+    const size_t ntext = sizeof(text_names) / sizeof(text_names[0]);
+
+    std::vector<const char*> names(kCommonAtomNames, kCommonAtomNames+ncommon);
+    names.insert(names.end(), text_names, text_names+ntext);
+
+    const atoms result = get_atoms(names.data(), int(names.size()));
+    m_common_atoms.assign(result.begin(), result.begin()+ncommon);
+    m_text_atoms.assign(result.begin()+ncommon, result.end());
+
+#if CLIP_ENABLE_IMAGE && defined(HAVE_PNG_H)
+    m_image_atoms.push_back(get_atom(MIME_IMAGE_PNG));
+#endif
+  }
+
   const atoms& get_text_format_atoms() const {
-    if (m_text_atoms.empty()) {
-      const char* names[] = {
-        // Prefer utf-8 formats first
-        "UTF8_STRING",
-        "text/plain;charset=utf-8",
-        "text/plain;charset=UTF-8",
-        "GTK_TEXT_BUFFER_CONTENTS", // Required for gedit (and maybe gtk+ apps)
-        // ANSI C strings?
-        "STRING",
-        "TEXT",
-        "text/plain",
-      };
-      m_text_atoms = get_atoms(names, sizeof(names) / sizeof(names[0]));
-    }
     return m_text_atoms;
   }
 
 #if CLIP_ENABLE_IMAGE
 
   const atoms& get_image_format_atoms() const {
-    if (m_image_atoms.empty()) {
-#ifdef HAVE_PNG_H
-      m_image_atoms.push_back(get_atom(MIME_IMAGE_PNG));
-#endif
-    }
     return m_image_atoms;
   }
 
@@ -903,23 +2988,112 @@ private:
   }
 #endif
 
-  bool set_x11_selection_owner() const {
-    xcb_void_cookie_t cookie =
-      xcb_set_selection_owner_checked(m_connection,
-                                      m_window,
-                                      get_atom(CLIPBOARD),
-                                      XCB_CURRENT_TIME);
-    xcb_generic_error_t* err =
-      xcb_request_check(m_connection,
-                        cookie);
-    if (err) {
-      free(err);
-      return false;
+#ifdef CLIP_SUPPORT_SAVE_TARGETS
+
+  // Starts the SAVE_TARGETS mechanism so the X11 CLIPBOARD_MANAGER
+  // saves our clipboard data from now on. Returns the request that
+  // is saving the current content (nullptr if there is nothing to
+  // wait). The content of each ownership is saved just one time.
+  request_ptr start_persist(const persist_callback& callback) {
+    const unsigned int sequence = m_owner_sequence;
+    if (!m_window || m_window != get_x11_selection_owner()) {
+      if (callback)
+        callback(false);
+      return nullptr;
     }
-    return true;
+
+    std::shared_ptr<PersistState> state;
+    bool saved = false;
+    {
+      std::lock_guard<std::mutex> lock(m_persist_mutex);
+      if (m_persisted && m_persisted_sequence == sequence) {
+        saved = true;
+      }
+      // Wait the request that is already saving this content
+      else if (m_persist && m_persist->sequence == sequence) {
+        if (callback)
+          m_persist->callbacks.push_back(callback);
+        return m_persist->req;
+      }
+      else {
+        state = std::make_shared<PersistState>();
+        state->sequence = sequence;
+        if (callback)
+          state->callbacks.push_back(callback);
+        state->req = make_request({ get_atom(SAVE_TARGETS) },
+                                  get_atom(CLIPBOARD_MANAGER));
+        state->req->end_time =
+          std::chrono::steady_clock::now() +
+          std::chrono::milliseconds(get_x11_persist_timeout());
+        m_persist = state;
+      }
+    }
+
+    if (saved) {
+      if (callback)
+        callback(true);
+      return nullptr;
+    }
+
+    request_ptr req = state->req;
+    req->on_done =
+      [this, state](Request& req) {
+        std::vector<persist_callback> callbacks;
+        {
+          std::lock_guard<std::mutex> lock(m_persist_mutex);
+          if (req.result) {
+            m_persisted = true;
+            m_persisted_sequence = state->sequence;
+          }
+          if (m_persist == state)
+            m_persist.reset();
+          callbacks.swap(state->callbacks);
+        }
+        for (const persist_callback& callback : callbacks)
+          callback(req.result);
+      };
+    submit_request(req);
+    return req;
+  }
+
+#endif // CLIP_SUPPORT_SAVE_TARGETS
+
+  // Takes the CLIPBOARD ownership for the content set in the lock
+  // that is being released. We don't wait the answer of the X server
+  // here, if the request fails the error is received in the
+  // background thread (see handle_error()).
+  void commit_selection_owner() {
+    m_owner_pending = false;
+
+    xcb_void_cookie_t cookie =
+      xcb_set_selection_owner(m_connection,
+                              m_window,
+                              get_atom(CLIPBOARD),
+                              XCB_CURRENT_TIME);
+    m_owner_sequence = cookie.sequence;
+    xcb_flush(m_connection);
+
+    // We don't wait the XFixes event to know that we are the new
+    // owner.
+    selection_changed(m_window);
   }
 
   xcb_window_t get_x11_selection_owner() const {
+    // The content set in the current lock is ours (we'll be the
+    // owner when the lock is released).
+    if (m_owner_pending)
+      return m_window;
+
+    // Use the cached owner if we know it (it's updated with the XFixes
+    // events).
+    size_t serial = 0;
+    if (m_xfixes) {
+      std::lock_guard<std::mutex> lock(m_selection_mutex);
+      if (m_owner_known)
+        return m_owner;
+      serial = m_selection_serial;
+    }
+
     xcb_window_t result = 0;
     xcb_get_selection_owner_cookie_t cookie =
       xcb_get_selection_owner(m_connection,
@@ -927,14 +3101,262 @@ private:
 
     xcb_get_selection_owner_reply_t* reply =
       xcb_get_selection_owner_reply(m_connection, cookie, nullptr);
+    after_round_trip();
     if (reply) {
       result = reply->owner;
       free(reply);
+
+      if (m_xfixes) {
+        std::lock_guard<std::mutex> lock(m_selection_mutex);
+        if (serial == m_selection_serial) {
+          m_owner = result;
+          m_owner_known = true;
+        }
+      }
     }
     return result;
   }
 
+  // Gets the list of targets available in the CLIPBOARD selection.
+  bool get_selection_targets(atoms& targets) const {
+    size_t serial = 0;
+    if (m_xfixes) {
+      std::lock_guard<std::mutex> lock(m_selection_mutex);
+      if (m_targets_known) {
+        targets = m_targets;
+        return true;
+      }
+      serial = m_selection_serial;
+    }
+
+    if (!get_data_from_selection_owner(
+          make_request({ get_atom(TARGETS) }),
+          [&targets](const ReplyBuffer& data) -> bool {
+            get_atoms_from_reply(data, targets);
+            return true;
+          })) {
+      return false;
+    }
+
+    set_selection_targets(serial, targets);
+    return true;
+  }
+
+  static void get_atoms_from_reply(const ReplyBuffer& data, atoms& output) {
+    // Each segment contains a whole number of atoms because the
+    // properties are read in slices of 32-bit units.
+    for (const auto& seg : data.segments()) {
+      const xcb_atom_t* sel_atoms = (const xcb_atom_t*)seg.data;
+      output.insert(output.end(),
+                    sel_atoms,
+                    sel_atoms + seg.size / sizeof(xcb_atom_t));
+    }
+  }
+
+  // Keeps the targets of the selection in cache if it didn't change
+  // since we asked for them (at the given "serial").
+  void set_selection_targets(const size_t serial, const atoms& targets) const {
+    if (!m_xfixes)
+      return;
+
+    std::lock_guard<std::mutex> lock(m_selection_mutex);
+    if (serial == m_selection_serial) {
+      m_targets = targets;
+      m_targets_known = true;
+    }
+  }
+
+  // Asks for the TARGETS of the new selection owner and the content
+  // of the formats specified in the x11_prefetch_policy in the
+  // background, so they are in cache when they are needed. Called
+  // from the background thread.
+  void prefetch_selection(const xcb_window_t owner) {
+    const x11_prefetch_policy policy = get_x11_prefetch_policy();
+    if (policy.formats.empty() || !owner || owner == m_window)
+      return;
+
+    const size_t serial = get_selection_serial();
+    request_ptr req = make_request({ get_atom(TARGETS) });
+    req->owner = owner;
+    req->on_done =
+      [this, owner, serial, policy](Request& req) {
+        if (!req.result || serial != get_selection_serial())
+          return;
+
+        atoms targets;
+        get_atoms_from_reply(req.data, targets);
+        set_selection_targets(serial, targets);
+
+        for (format f : policy.formats) {
+          // The first target (in order of preference) of the format
+          // available in the selection.
+          for (xcb_atom_t target : get_format_atoms(f)) {
+            if (std::find(targets.begin(), targets.end(), target) != targets.end()) {
+              prefetch_target(owner, serial, target, policy.max_size);
+              break;
+            }
+          }
+        }
+      };
+    submit_request(req);
+  }
+
+  void prefetch_target(const xcb_window_t owner,
+                       const size_t serial,
+                       const xcb_atom_t target,
+                       const size_t max_size) {
+    request_ptr req = make_request({ target });
+    req->owner = owner;
+    req->max_size = max_size;
+    req->on_done =
+      [this, owner, serial, target](Request& req) {
+        if (!req.result)
+          return;
+
+        reply_buffer_ptr data = std::make_shared<ReplyBuffer>();
+        data->swap(req.data);
+        add_cached_transfer(owner, serial, target, data);
+        ++m_prefetches;
+      };
+    submit_request(req);
+  }
+
+  // Removes from "candidates" the targets that the owner doesn't
+  // support (keeping the order of preference).
+  void select_supported_targets(const xcb_window_t owner,
+                                atoms& candidates) const {
+    atoms targets;
+    const bool has_targets = get_selection_targets(targets);
+
+    std::lock_guard<std::mutex> lock(m_selection_mutex);
+    candidates.erase(
+      std::remove_if(candidates.begin(),
+                     candidates.end(),
+                     [&](const xcb_atom_t atom) {
+                       if (has_targets &&
+                           std::find(targets.begin(),
+                                     targets.end(),
+                                     atom) == targets.end()) {
+                         return true;
+                       }
+                       return (m_refused_owner == owner &&
+                               std::find(m_refused_targets.begin(),
+                                         m_refused_targets.end(),
+                                         atom) != m_refused_targets.end());
+                     }),
+      candidates.end());
+  }
+
+  // Remembers the targets that the given owner refused to convert, so
+  // we don't ask for them again (until the owner changes, or until
+  // the lock is released if we don't have XFixes).
+  void add_refused_targets(const xcb_window_t owner,
+                           const atoms& refused) const {
+    std::lock_guard<std::mutex> lock(m_selection_mutex);
+    if (m_refused_owner != owner) {
+      m_refused_owner = owner;
+      m_refused_targets.clear();
+    }
+    for (xcb_atom_t atom : refused) {
+      if (std::find(m_refused_targets.begin(),
+                    m_refused_targets.end(),
+                    atom) == m_refused_targets.end()) {
+        m_refused_targets.push_back(atom);
+      }
+    }
+  }
+
+  size_t get_selection_serial() const {
+    std::lock_guard<std::mutex> lock(m_selection_mutex);
+    return m_selection_serial;
+  }
+
+  // Called when the CLIPBOARD selection has a new owner (or the same
+  // owner with new content).
+  void selection_changed(const xcb_window_t owner) const {
+    std::lock_guard<std::mutex> lock(m_selection_mutex);
+    ++m_selection_serial;
+    m_owner = owner;
+    m_owner_known = true;
+    m_targets_known = false;
+    m_targets.clear();
+    m_refused_owner = 0;
+    m_refused_targets.clear();
+  }
+
+  // We don't know who is the owner (e.g. we couldn't take the
+  // ownership), so we'll have to ask the X server again.
+  void forget_selection_owner() const {
+    std::lock_guard<std::mutex> lock(m_selection_mutex);
+    ++m_selection_serial;
+    m_owner_known = false;
+    m_targets_known = false;
+    m_targets.clear();
+  }
+
+#ifdef HAVE_XCB_XFIXES_H
+
+  // Subscribes to XFixes selection events, so we know when the
+  // CLIPBOARD owner changes without asking the X server each time.
+  void init_xfixes() {
+    const xcb_query_extension_reply_t* ext =
+      xcb_get_extension_data(m_connection, &xcb_xfixes_id);
+    if (!ext || !ext->present)
+      return;
+
+    // The XFixes version must be negotiated before using it.
+    xcb_xfixes_query_version_reply_t* version =
+      xcb_xfixes_query_version_reply(
+        m_connection,
+        xcb_xfixes_query_version(m_connection,
+                                 XCB_XFIXES_MAJOR_VERSION,
+                                 XCB_XFIXES_MINOR_VERSION),
+        nullptr);
+    if (!version)
+      return;
+    free(version);
+
+    xcb_xfixes_select_selection_input(
+      m_connection,
+      m_window,
+      get_atom(CLIPBOARD),
+      XCB_XFIXES_SELECTION_EVENT_MASK_SET_SELECTION_OWNER |
+      XCB_XFIXES_SELECTION_EVENT_MASK_SELECTION_WINDOW_DESTROY |
+      XCB_XFIXES_SELECTION_EVENT_MASK_SELECTION_CLIENT_CLOSE);
+    xcb_flush(m_connection);
+
+    m_xfixes = true;
+    m_xfixes_event_base = ext->first_event;
+  }
+
+  void handle_xfixes_selection_notify_event(xcb_xfixes_selection_notify_event_t* event) {
+    if (event->selection != get_atom(CLIPBOARD))
+      return;
+
+    selection_changed(event->owner);
+    prefetch_selection(event->owner);
+
+    // Call the watchers without locking m_watchers_mutex, so they
+    // can call unwatch().
+    std::vector<watch_callback> watchers;
+    {
+      std::lock_guard<std::mutex> lock(m_watchers_mutex);
+      for (const auto& it : m_watchers)
+        watchers.push_back(it.second);
+    }
+    if (!watchers.empty()) {
+      clipboard_change change;
+      change.owner = event->owner;
+      change.timestamp = event->selection_timestamp;
+      for (const auto& callback : watchers)
+        callback(change);
+    }
+  }
+
+#endif // HAVE_XCB_XFIXES_H
+
   xcb_atom_t get_format_atom(const format f) const {
+    std::lock_guard<std::mutex> lock(m_atoms_mutex);
     int i = f - kBaseForCustomFormats;
     if (i >= 0 && i < int(m_custom_formats.size()))
       return m_custom_formats[i];
@@ -942,29 +3364,130 @@ private:
       return 0;
   }
 
-  void encode_data_on_demand(std::pair<const xcb_atom_t, buffer_ptr>& e) {
-#if defined(CLIP_ENABLE_IMAGE) && defined(HAVE_PNG_H)
-    if (e.first == get_atom(MIME_IMAGE_PNG)) {
-      assert(m_image.is_valid());
+  // Returns true if the data requested in the SelectionRequest event
+  // must be encoded before we can send it (i.e. it's null in "data").
+  bool needs_encoding(xcb_selection_request_event_t* event,
+                      const data_map& data) {
+    auto is_null = [&data](const xcb_atom_t target) -> bool {
+      auto it = data.find(target);
+      return (it != data.end() && !it->second);
+    };
+
+    if (event->target != get_atom(MULTIPLE))
+      return is_null(event->target);
+
+    bool result = false;
+    xcb_get_property_reply_t* reply =
+      get_and_delete_property(event->requestor,
+                              event->property,
+                              get_atom(ATOM_PAIR),
+                              false);
+    if (reply) {
+      const xcb_atom_t* pairs = (const xcb_atom_t*)xcb_get_property_value(reply);
+      const size_t n = xcb_get_property_value_length(reply) / sizeof(xcb_atom_t);
+      for (size_t i=0; i+1<n && !result; i+=2)
+        result = is_null(pairs[i]);
+      free(reply);
+    }
+    return result;
+  }
+
+  // Starts the encoding of the image in other thread. Returns false if
+  // there is nothing to encode.
+  bool start_encoding() {
+#if CLIP_ENABLE_IMAGE && defined(HAVE_PNG_H)
+    // The encoding is already in progress.
+    if (m_encode_thread.joinable())
+      return true;
+
+    std::shared_ptr<image> img;
+    size_t generation;
+    {
+      SharedLockGuard lock(m_mutex);
       if (!m_image.is_valid())
-        return;
+        return false;
+      img = std::make_shared<image>(m_image);
+      generation = m_image_generation;
+    }
 
-      std::vector<uint8_t> output;
-      if (x11::write_png(m_image, output)) {
-        e.second =
-          std::make_shared<std::vector<uint8_t>>(
+    m_encode_thread = std::thread(
+      [this, img, generation]{
+        buffer_ptr buf;
+        std::vector<uint8_t> output;
+        if (x11::write_png(*img, output)) {
+          buf = std::make_shared<std::vector<uint8_t>>(
             std::move(output));
+        }
+        // else { TODO report png conversion errors }
+
+        {
+          std::lock_guard<std::mutex> lock(m_requests_mutex);
+          m_encoded = true;
+          m_encoded_generation = generation;
+          m_encoded_data = buf;
+        }
+        wake_up_event_thread();
+      });
+    return true;
+#else
+    return false;
+#endif
+  }
+
+  // Called from the background thread to answer the SelectionRequest
+  // events that were waiting for the encoding.
+  void process_encoded_data() {
+#if CLIP_ENABLE_IMAGE && defined(HAVE_PNG_H)
+    size_t generation;
+    buffer_ptr buf;
+    {
+      std::lock_guard<std::mutex> lock(m_requests_mutex);
+      if (!m_encoded)
+        return;
+      m_encoded = false;
+      generation = m_encoded_generation;
+      buf.swap(m_encoded_data);
+    }
+    m_encode_thread.join();
+
+    {
+      std::lock_guard<SharedMutex> lock(m_mutex);
+      // Discard the result if the image has changed in the meantime
+      // (the new image will be encoded when it's requested).
+      if (generation == m_image_generation) {
+        auto it = m_data.find(get_atom(MIME_IMAGE_PNG));
+        if (it != m_data.end() && !it->second) {
+          // If the image cannot be encoded we don't offer this format
+          // anymore.
+          if (buf)
+            it->second = buf;
+          else
+            m_data.erase(it);
+        }
       }
-      // else { TODO report png conversion errors }
     }
-#endif // defined(CLIP_ENABLE_IMAGE) && defined(HAVE_PNG_H)
-  }
 
-  // Access to the whole Manager
-  std::mutex m_mutex;
+    std::vector<xcb_selection_request_event_t> events;
+    events.swap(m_waiting_encoding);
+    for (auto& event : events)
+      handle_selection_request_event(&event);
+#endif
+  }
 
-  // Lock used in the main thread using the Manager (i.e. by lock::impl)
-  mutable std::unique_lock<std::mutex> m_lock;
+  // Access to the Manager data (m_data and m_image). It's locked in
+  // shared mode to read the data, and exclusively to modify it.
+  mutable SharedMutex m_mutex;
+
+  // Lock used by the threads using the Manager (i.e. by lock::impl).
+  // The threads that own this lock (one exclusive or several shared
+  // holders) keep m_mutex locked too in the same mode (except when
+  // they wait for a selection owner). Waiting threads are queued in
+  // m_lock_waiters with a ticket.
+  mutable std::mutex m_lock_mutex;
+  std::condition_variable m_lock_cv;
+  std::vector<LockHolder> m_lock_holders;
+  std::deque<size_t> m_lock_waiters;
+  size_t m_next_lock_ticket = 0;
 
   // Connection to X11 server
   xcb_connection_t* m_connection;
@@ -973,46 +3496,86 @@ private:
   // all events related about the clipboard in a background thread
   xcb_window_t m_window;
 
-  // Used to wait/notify the arrival of the SelectionNotify event when
-  // we requested the clipboard content from other selection owner.
-  mutable std::condition_variable m_cv;
-
   // Thread used to run a background message loop to wait X11 events
   // about clipboard. The X11 selection owner will be a hidden window
   // created by us just for the clipboard purpose/communication.
   std::thread m_thread;
 
-  // Internal callback used when a SelectionNotify is received (or the
-  // whole data content is received by the INCR method). So this
-  // callback can use the notification by different purposes (e.g. get
-  // the data length only, or get/process the data content, etc.).
-  mutable notify_callback m_callback;
-
-  // Result returned by the m_callback. Used as return value in the
-  // get_data_from_selection_owner() function. For example, if the
-  // callback must read a "image/png" file from the clipboard data and
-  // fails, the callback can return false and finally the get_image()
-  // will return false (i.e. there is data, but it's not a valid image
-  // format).
-  std::atomic<bool> m_callback_result;
-
-  // Cache of known atoms
-  mutable std::map<std::string, xcb_atom_t> m_atoms;
-
-  // Cache of common used atoms by us
-  mutable atoms m_common_atoms;
-
-  // Cache of atoms related to text or image content
-  mutable atoms m_text_atoms;
+  // True if m_connection and m_window are owned by the application
+  // (see clip::x11::set_connection()). In this case we don't read
+  // the events from the connection, the application gives them to
+  // us and we keep them in m_external_events (guarded by
+  // m_requests_mutex) until they are processed.
+  const bool m_external;
+  std::deque<xcb_generic_event_t*> m_external_events;
+
+  // True if there is no background thread (m_thread) and the events
+  // are processed by the user threads (in pump_x11_events() or
+  // dispatch_pending()). Only one thread at a time can process the
+  // events: the one that locks m_pump_mutex (its ID is m_pump_thread).
+  const bool m_threadless;
+  std::mutex m_pump_mutex;
+  std::atomic<std::thread::id> m_pump_thread;
+
+  // True if xcb could have queued events in a round trip of a user
+  // thread in threadless mode (see after_round_trip()).
+  mutable std::atomic<bool> m_queued_events;
+
+  // Pipe used to wake up the background thread (m_thread) when
+  // there are new requests to process.
+  int m_wake_pipe[2] = { -1, -1 };
+
+  // Requests to be processed by the background thread. Guarded by
+  // m_requests_mutex. If m_stopped is true the background thread is
+  // not running and new requests fail immediately.
+  mutable std::mutex m_requests_mutex;
+  mutable std::deque<request_ptr> m_pending_requests;
+  bool m_stopped;
+
+  // Requests that the background thread is processing now, and the
+  // pool of "CLIP_PROP_n" properties to receive their data (only
+  // accessed from the background thread).
+  std::vector<request_ptr> m_active_requests;
+  atoms m_free_properties;
+  size_t m_properties_count = 0;
+
+  // Properties of abandoned INCR transfers, and when we stop waiting
+  // their next chunk (only accessed from the background thread).
+  std::map<xcb_atom_t, std::chrono::steady_clock::time_point> m_draining_properties;
+
+  // All the "CLIP_PROP_n" properties (guarded by m_atoms_mutex, used
+  // to know if an event of an external connection is for us).
+  atoms m_all_properties;
+
+  // Latency (in milliseconds) of the answers of each selection owner
+  // (only accessed from the background thread).
+  struct OwnerLatency {
+    double average;
+    double variation;
+  };
+  std::map<xcb_window_t, OwnerLatency> m_owner_latencies;
+
+  // Cache of known atoms. It's used from the background thread and
+  // the user threads, so it's guarded by m_atoms_mutex (the same for
+  // m_custom_formats).
+  mutable std::mutex m_atoms_mutex;
+  mutable std::unordered_map<std::string, xcb_atom_t> m_atoms;
+
+  // Common used atoms by us (interned in the constructor)
+  atoms m_common_atoms;
+
+  // Atoms related to text or image content (interned in the
+  // constructor)
+  atoms m_text_atoms;
 #if CLIP_ENABLE_IMAGE
-  mutable atoms m_image_atoms;
+  atoms m_image_atoms;
 #endif
 
   // Actual clipboard data generated by us (when we "copy" content in
   // the clipboard, it means that we own the X11 "CLIPBOARD"
   // selection, and in case of SelectionRequest events, we've to
   // return the data stored in this "m_data" field)
-  mutable std::map<xcb_atom_t, buffer_ptr> m_data;
+  data_map m_data;
 
   // Copied image in the clipboard. As we have to transfer the image
   // in some specific format (e.g. image/png) we want to keep a copy
@@ -1020,98 +3583,383 @@ private:
   // requested by other process.
 #if CLIP_ENABLE_IMAGE
   mutable image m_image;
+
+  // Incremented each time m_image changes, to know if the encoded
+  // data is still valid.
+  size_t m_image_generation = 0;
 #endif
 
-  // True if we have received an INCR notification so we're going to
-  // process several PropertyNotify to concatenate all data chunks.
-  bool m_incr_process;
+  // Thread used to encode the image (e.g. to image/png) when it's
+  // requested by other process, so the background thread (m_thread)
+  // can continue answering other requests. The result is given in
+  // m_encoded_* fields (guarded by m_requests_mutex), and the
+  // SelectionRequest events that are waiting the encoded data are
+  // kept in m_waiting_encoding.
+  std::thread m_encode_thread;
+  bool m_encoded = false;
+  size_t m_encoded_generation = 0;
+  buffer_ptr m_encoded_data;
+  std::vector<xcb_selection_request_event_t> m_waiting_encoding;
+
+  // Data received from the selection owner in the current lock (or
+  // while the selection doesn't change if we receive XFixes events),
+  // so we don't need to transfer it again (e.g. in a
+  // get_data_length() + get_data() sequence).
+  struct CachedTransfer {
+    xcb_window_t owner;
+    size_t serial;
+    xcb_atom_t target;
+    reply_buffer_ptr data;
+  };
+  mutable std::mutex m_transfer_cache_mutex;
+  mutable std::vector<CachedTransfer> m_transfer_cache;
+
+  // True if we receive XFixes SelectionNotify events when the
+  // CLIPBOARD owner changes, so we can keep the owner and its
+  // TARGETS in cache.
+  bool m_xfixes = false;
+  uint8_t m_xfixes_event_base = 0;
+
+  // Callbacks registered with clip::watch() to be called from the
+  // background thread when the CLIPBOARD owner changes.
+  std::mutex m_watchers_mutex;
+  std::map<watch_id, watch_callback> m_watchers;
+  watch_id m_next_watch_id = 1;
+
+  // Information about the CLIPBOARD selection guarded by
+  // m_selection_mutex. The serial is incremented each time the
+  // selection changes (the owner and targets are valid only if we
+  // receive XFixes events).
+  mutable std::mutex m_selection_mutex;
+  mutable size_t m_selection_serial = 1;
+  mutable bool m_owner_known = false;
+  mutable xcb_window_t m_owner = 0;
+  mutable bool m_targets_known = false;
+  mutable atoms m_targets;
+
+  // Targets that the owner refused to convert (negative cache, also
+  // guarded by m_selection_mutex).
+  mutable xcb_window_t m_refused_owner = 0;
+  mutable atoms m_refused_targets;
+
+  // Number returned by change_count() without XFixes (a new one in
+  // each call).
+  mutable std::atomic<size_t> m_change_count;
+
+  // Statistics of the m_transfer_cache usage
+  mutable std::atomic<size_t> m_transfer_cache_hits;
+  mutable std::atomic<size_t> m_transfer_cache_misses;
+
+  // Number of transfers received in the background (with the
+  // x11_prefetch_policy) when the CLIPBOARD owner changed.
+  std::atomic<size_t> m_prefetches;
+
+  // Reads in progress from the CLIPBOARD owner (guarded by
+  // m_in_flight_mutex), and number of reads that waited for other
+  // read instead of starting a new transfer.
+  mutable std::mutex m_in_flight_mutex;
+  mutable std::vector<in_flight_read_ptr> m_in_flight_reads;
+  mutable std::atomic<size_t> m_coalesced_reads;
+
+#if CLIP_ENABLE_IMAGE && defined(HAVE_PNG_H)
+  // Last image decoded from the CLIPBOARD owner (guarded by
+  // m_decoded_image_mutex, which is locked while the image is
+  // received and decoded).
+  mutable std::mutex m_decoded_image_mutex;
+  mutable image m_decoded_image;
+  mutable xcb_window_t m_decoded_image_owner = 0;
+  mutable size_t m_decoded_image_serial = 0;
+#endif
 
-  // Variable used to wait more time if we've received an INCR
-  // notification, which means that we're going to receive large
-  // amounts of data from the selection owner.
-  mutable bool m_incr_received;
+  // Number of times that commit_selection_owner() failed.
+  std::atomic<size_t> m_ownership_errors;
 
-  // Target/selection format used in the SelectionNotify. Used in the
-  // INCR method to get data from the same property in the same format
-  // (target) on each PropertyNotify.
-  xcb_atom_t m_target_atom;
+  // True if the content was modified in the current lock, so we have
+  // to take the clipboard ownership when it's released (only
+  // modified by the thread that locked the Manager, but it's read by
+  // persist() without the lock).
+  std::atomic<bool> m_owner_pending;
 
-  // Each time we receive data from the selection owner, we put that
-  // data in this buffer. If we get the data with the INCR method,
-  // we'll concatenate chunks of data in this buffer to complete the
-  // whole clipboard content.
-  buffer_ptr m_reply_data;
+  // Sequence number of the last SetSelectionOwner request, to check
+  // its error and ignore older SelectionClear events.
+  std::atomic<unsigned int> m_owner_sequence;
 
-  // Used to concatenate chunks of data in "m_reply_data" from several
-  // PropertyNotify when we are getting the selection owner data with
-  // the INCR method.
-  size_t m_reply_offset;
+#ifdef CLIP_SUPPORT_SAVE_TARGETS
+  // SAVE_TARGETS request in progress to save the content of the
+  // ownership with the given sequence number, and the callbacks of
+  // persist() waiting its result.
+  struct PersistState {
+    request_ptr req;
+    unsigned int sequence = 0;
+    std::vector<persist_callback> callbacks;
+  };
+
+  // Guards m_persist, m_persisted, and m_persisted_sequence.
+  std::mutex m_persist_mutex;
+  std::shared_ptr<PersistState> m_persist;
+
+  // True if the clipboard manager has saved the content of the
+  // ownership with the m_persisted_sequence number.
+  bool m_persisted = false;
+  unsigned int m_persisted_sequence = 0;
+#endif
 
-  // List of user-defined formats/atoms.
+  // List of user-defined formats/atoms (guarded by m_atoms_mutex).
   std::vector<xcb_atom_t> m_custom_formats;
+
+  // State of an INCR transfer when we are the selection owner and we
+  // are sending data to a requestor in chunks.
+  struct IncrTransfer {
+    xcb_atom_t target;
+    buffer_ptr data;
+    size_t offset;
+
+    // When we drop the transfer if the requestor doesn't read the
+    // current chunk (see retire_stalled_incr_transfers()).
+    std::chrono::steady_clock::time_point deadline;
+  };
+
+  // INCR transfers in progress for each requestor window/property.
+  // Only accessed from the background thread.
+  std::map<std::pair<xcb_window_t, xcb_atom_t>, IncrTransfer> m_incr_transfers;
+
+  // Event masks that we had selected in each requestor window before
+  // its first INCR transfer (the events of the application with an
+  // external connection), restored when its last transfer ends.
+  std::map<xcb_window_t, uint32_t> m_requestor_event_masks;
+
+  // Maximum size of the data that can be sent in one ChangeProperty
+  // request, greater data is sent with the INCR method.
+  mutable size_t m_max_property_size;
 };
 
-Manager* manager = nullptr;
+// The manager can be created from the initialize_async() thread while
+// other threads use it, so it's atomic.
+std::atomic<Manager*> manager(nullptr);
+
+// Protects the creation of the manager.
+std::mutex manager_mutex;
+
+// Connection of the application given in x11::set_connection().
+xcb_connection_t* external_connection = nullptr;
+xcb_window_t external_window = 0;
+
+// Background initialization started with initialize_async().
+std::mutex init_mutex;
+std::future<size_t> init_future;
+size_t init_usecs = 0;
 
 void delete_manager_atexit() {
-  if (manager) {
-    delete manager;
-    manager = nullptr;
-  }
+  // Don't destroy the manager while it's being created.
+  wait_initialization();
+
+  std::lock_guard<std::mutex> lock(manager_mutex);
+  delete manager.exchange(nullptr);
 }
 
 Manager* get_manager() {
-  if (!manager) {
-    manager = new Manager;
+  Manager* result = manager;
+  if (result)
+    return result;
+
+  std::lock_guard<std::mutex> lock(manager_mutex);
+  result = manager;
+  if (!result) {
+    result = new Manager(external_connection, external_window);
+    manager = result;
     std::atexit(delete_manager_atexit);
   }
-  return manager;
+  return result;
 }
 
 } // anonymous namespace
 
-lock::impl::impl(void*) : m_locked(false) {
-  m_locked = get_manager()->try_lock();
+// A context with a display has its own Manager, the default context
+// uses the global one (created on demand with get_manager()).
+class context::impl {
+public:
+  explicit impl(const std::string& display) {
+    if (!display.empty())
+      m_manager.reset(new Manager(nullptr, 0, display.c_str()));
+  }
+
+  static impl* default_context() {
+    static impl ctx((std::string()));
+    return &ctx;
+  }
+
+  Manager* manager() {
+    if (m_manager)
+      return m_manager.get();
+    else
+      return get_manager();
+  }
+
+private:
+  std::unique_ptr<Manager> m_manager;
+};
+
+context::context(const std::string& display)
+  : p(new impl(display)) {
+}
+
+context::~context() = default;
+
+format context::register_format(const std::string& name) {
+  return p->manager()->register_format(name);
+}
+
+std::vector<format> context::register_formats(const std::vector<std::string>& names) {
+  return p->manager()->register_formats(names);
+}
+
+size_t context::change_count() {
+  return p->manager()->change_count();
+}
+
+watch_id context::watch(const watch_callback& callback) {
+  return p->manager()->watch(callback);
+}
+
+void context::unwatch(watch_id id) {
+  p->manager()->unwatch(id);
+}
+
+void context::get_text_async(const text_callback& callback,
+                             const cancel_token& token) {
+  p->manager()->get_data_async(
+    text_format(), token,
+    [callback](bool ok, const ReplyBuffer& data) {
+      std::string value;
+      if (ok) {
+        value.resize(data.size());
+        if (!value.empty())
+          data.copy_to((uint8_t*)&value[0], value.size());
+
+        // Trim the text to the first null character
+        value.resize(std::strlen(value.c_str()));
+      }
+      callback(ok, std::move(value));
+    });
+}
+
+void context::get_data_async(format f,
+                             const data_callback& callback,
+                             const cancel_token& token) {
+  p->manager()->get_data_async(
+    f, token,
+    [callback](bool ok, const ReplyBuffer& data) {
+      std::vector<char> buf;
+      if (ok) {
+        buf.resize(data.size());
+        if (!buf.empty())
+          data.copy_to((uint8_t*)&buf[0], buf.size());
+      }
+      callback(ok, std::move(buf));
+    });
+}
+
+#if CLIP_ENABLE_IMAGE
+
+void context::get_image_async(const image_callback& callback,
+                              const cancel_token& token) {
+#ifdef HAVE_PNG_H
+  p->manager()->get_data_async(
+    image_format(), token,
+    [callback](bool ok, const ReplyBuffer& data) {
+      image img;
+      if (ok) {
+        std::vector<uint8_t> storage;
+        ok = x11::read_png(data.contiguous_data(storage),
+                           data.size(),
+                           &img, nullptr);
+      }
+      callback(ok, std::move(img));
+    });
+#else
+  callback(false, image());
+#endif
+}
+
+#endif // CLIP_ENABLE_IMAGE
+
+void context::persist(const persist_callback& callback) {
+  p->manager()->persist(callback);
+}
+
+int context::dispatch_pending() {
+  return p->manager()->dispatch_pending();
+}
+
+lock::impl::impl(void*, int timeout_msecs, lock_mode mode)
+  : m_locked(false)
+  , m_shared(mode == lock_mode::shared)
+  , m_context(context::impl::default_context()) {
+  m_locked = m_context->manager()->try_lock(timeout_msecs, m_shared, &m_contended);
+}
+
+lock::impl::impl(context::impl* ctx, int timeout_msecs, lock_mode mode)
+  : m_locked(false)
+  , m_shared(mode == lock_mode::shared)
+  , m_context(ctx) {
+  m_locked = m_context->manager()->try_lock(timeout_msecs, m_shared, &m_contended);
 }
 
 lock::impl::~impl() {
   if (m_locked)
-    manager->unlock();
+    m_context->manager()->unlock();
+}
+
+void lock::impl::set_x11_read_timeout(int msecs) {
+  if (m_locked) {
+    m_context->manager()->set_read_deadline(
+      std::chrono::steady_clock::now() +
+      std::chrono::milliseconds(msecs));
+  }
 }
 
 bool lock::impl::clear() {
-  manager->clear();
+  m_context->manager()->clear();
   return true;
 }
 
 bool lock::impl::is_convertible(format f) const {
-  return manager->is_convertible(f);
+  return m_context->manager()->is_convertible(f);
 }
 
 bool lock::impl::set_data(format f, const char* buf, size_t len) {
-  return manager->set_data(f, buf, len);
+  return m_context->manager()->set_data(f, buf, len);
 }
 
 bool lock::impl::get_data(format f, char* buf, size_t len) const {
-  return manager->get_data(f, buf, len);
+  return m_context->manager()->get_data(f, buf, len);
 }
 
 size_t lock::impl::get_data_length(format f) const {
-  return manager->get_data_length(f);
+  return m_context->manager()->get_data_length(f);
+}
+
+bool lock::impl::get_data_stream(format f, const data_stream_callback& callback) const {
+  return m_context->manager()->get_data_stream(f, callback);
+}
+
+bool lock::impl::get_many(const std::vector<format>& formats,
+                          std::vector<std::vector<char>>& data) const {
+  return m_context->manager()->get_many(formats, data);
 }
 
 #if CLIP_ENABLE_IMAGE
 
 bool lock::impl::set_image(const image& image) {
-  return manager->set_image(image);
+  return m_context->manager()->set_image(image);
 }
 
 bool lock::impl::get_image(image& output_img) const {
-  return manager->get_image(output_img);
+  return m_context->manager()->get_image(output_img);
 }
 
 bool lock::impl::get_image_spec(image_spec& spec) const {
-  return manager->get_image_spec(spec);
+  return m_context->manager()->get_image_spec(spec);
 }
 
 #endif // CLIP_ENABLE_IMAGE
@@ -1120,4 +3968,72 @@ format register_format(const std::string& name) {
   return get_manager()->register_format(name);
 }
 
+size_t change_count() {
+  return get_manager()->change_count();
+}
+
+void initialize_async() {
+  std::lock_guard<std::mutex> lock(init_mutex);
+  if (init_future.valid() || init_usecs > 0)
+    return;
+
+  init_future = std::async(
+    std::launch::async,
+    []() -> size_t {
+      const auto start = std::chrono::steady_clock::now();
+      get_manager();
+      return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start).count();
+    });
+}
+
+size_t wait_initialization() {
+  std::lock_guard<std::mutex> lock(init_mutex);
+  if (init_future.valid())
+    init_usecs = init_future.get();
+  return init_usecs;
+}
+
+int get_x11_fd() {
+  return get_manager()->get_fd();
+}
+
+void cancel_token::cancel() {
+  *m_cancelled = true;
+
+  std::lock_guard<std::mutex> lock(managers_mutex);
+  for (const Manager* m : managers)
+    m->notify_cancel();
+}
+
+namespace x11 {
+
+bool set_connection(xcb_connection_t* connection, unsigned long window) {
+  std::lock_guard<std::mutex> lock(manager_mutex);
+
+  // The Manager was already created with its own connection.
+  if (manager)
+    return false;
+
+  external_connection = connection;
+  external_window = xcb_window_t(window);
+  return true;
+}
+
+bool handle_event(const void* xcb_event) {
+  if (Manager* m = manager)
+    return m->handle_external_event((const xcb_generic_event_t*)xcb_event);
+  else
+    return false;
+}
+
+} // namespace x11
+
+x11_stats get_x11_stats() {
+  if (Manager* m = manager)
+    return m->get_stats();
+  else
+    return x11_stats();
+}
+
 } // namespace clip
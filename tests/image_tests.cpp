@@ -10,6 +10,7 @@
 
 #include <cstdint>
 #include <cstring>
+#include <future>
 
 using namespace clip;
 
@@ -69,6 +70,19 @@ int main(int argc, char** argv)
     }
   }
 
+  // Get the image asynchronously (on X11 the image is encoded in
+  // other thread to be sent through the X server)
+  {
+    std::promise<image> promise;
+    get_image_async([&promise](bool ok, image img) {
+                      promise.set_value(ok ? std::move(img): image());
+                    });
+    image img = promise.get_future().get();
+    EXPECT_TRUE(img.is_valid());
+    EXPECT_EQ(3, img.spec().width);
+    EXPECT_EQ(2, img.spec().height);
+  }
+
   clear();
   EXPECT_FALSE(has(image_format()));
 }
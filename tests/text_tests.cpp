@@ -8,13 +8,27 @@
 
 #include "clip.h"
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 
 using namespace clip;
 
 int main(int argc, char** argv)
 {
+  // Initialize the clipboard in the background
+  initialize_async();
+  const size_t init_usecs = wait_initialization();
+  EXPECT_EQ(init_usecs, wait_initialization());
+
   // High API
   {
     std::string value;
@@ -44,5 +58,290 @@ int main(int argc, char** argv)
     std::vector<char> buf(12);
     EXPECT_TRUE(l.get_data(text_format(), &buf[0], buf.size()));
     EXPECT_EQ("hello world", std::string(&buf[0]));
+
+    // Get the data in chunks (without the extra zero character)
+    std::string chunks;
+    EXPECT_TRUE(l.get_data_stream(text_format(),
+                                  [&chunks](const char* buf, size_t len) {
+                                    chunks.append(buf, len);
+                                  }));
+    EXPECT_EQ("hello world", chunks);
+  }
+
+  // Lock with a timeout
+  {
+    const lock_stats stats = get_lock_stats();
+    {
+      lock l(nullptr, 500);
+      EXPECT_TRUE(l.locked());
+    }
+    EXPECT_EQ(stats.locks+1, get_lock_stats().locks);
+  }
+
+  // Deadline for the reads of a lock (on X11 the content of other
+  // context is received through the X server)
+  if (get_x11_fd() >= 0 && std::getenv("DISPLAY")) {
+    context owner(std::getenv("DISPLAY"));
+    EXPECT_TRUE(owner.set_text("deadline"));
+
+    auto get_chunks = [](lock& l, std::string& chunks) -> bool {
+      return l.get_data_stream(text_format(),
+                               [&chunks](const char* buf, size_t len) {
+                                 chunks.append(buf, len);
+                               });
+    };
+    {
+      lock l;
+      l.set_x11_read_timeout(0);
+      std::string chunks;
+      EXPECT_FALSE(get_chunks(l, chunks));
+    }
+    {
+      lock l;
+      l.set_x11_read_timeout(5000);
+      std::string chunks;
+      EXPECT_TRUE(get_chunks(l, chunks));
+      EXPECT_EQ("deadline", chunks);
+    }
+  }
+
+  // Shared lock (read-only)
+  {
+    set_text("shared");
+    lock l(lock_mode::shared);
+    EXPECT_TRUE(l.locked());
+    EXPECT_TRUE(l.is_convertible(text_format()));
+    EXPECT_FALSE(l.set_data(text_format(), "other", 5));
+    EXPECT_FALSE(l.clear());
+  }
+  EXPECT_TRUE(has(text_format()));
+
+  // Ask to keep the clipboard content when the process exits
+  {
+    set_text("persist");
+    std::promise<bool> result;
+    persist([&result](bool ok) {
+              result.set_value(ok);
+            });
+
+    // On X11 the result depends on the clipboard manager of the
+    // session (there is no one with xvfb-run), so we just check that
+    // the callback is called. On other platforms the content is
+    // always kept.
+    const bool ok = result.get_future().get();
+    if (get_x11_fd() < 0)
+      EXPECT_TRUE(ok);
+  }
+
+  // The synchronous functions don't block the thread that calls the
+  // watch() callbacks
+  {
+    auto result = std::make_shared<std::promise<std::string>>();
+    auto called = std::make_shared<std::atomic<bool>>(false);
+    const watch_id id =
+      watch([result, called](const clipboard_change&) {
+              if (called->exchange(true))
+                return;
+              std::string value;
+              get_text(value);
+              result->set_value(value);
+            });
+    if (id) {
+      set_text("watched");
+      EXPECT_EQ("watched", result->get_future().get());
+      unwatch(id);
+    }
+  }
+
+  // Get the data only if it has changed
+  {
+    set_text("first");
+    size_t count = 0;
+    std::vector<char> data;
+    EXPECT_TRUE(get_data_if_changed(text_format(), count, data));
+    EXPECT_EQ("first", std::string(data.begin(), data.end()));
+
+    set_text("second");
+    EXPECT_TRUE(count != change_count());
+    EXPECT_TRUE(get_data_if_changed(text_format(), count, data));
+    EXPECT_EQ("second", std::string(data.begin(), data.end()));
+  }
+
+  // Async API
+  {
+    set_text("hello async");
+
+    std::promise<std::string> promise;
+    std::future<std::string> future = promise.get_future();
+    get_text_async([&promise](bool ok, std::string value) {
+                     promise.set_value(ok ? value: std::string());
+                   });
+    EXPECT_EQ("hello async", future.get());
+
+    // Several requests in progress at the same time
+    std::promise<std::string> promise1, promise2;
+    get_text_async([&promise1](bool ok, std::string value) {
+                     promise1.set_value(ok ? value: std::string());
+                   });
+    get_data_async(text_format(),
+                   [&promise2](bool ok, std::vector<char> data) {
+                     promise2.set_value(ok ? std::string(data.begin(), data.end()):
+                                             std::string());
+                   });
+    EXPECT_EQ("hello async", promise1.get_future().get());
+    EXPECT_EQ("hello async", promise2.get_future().get());
+
+    // The synchronous functions don't block the thread that calls
+    // the asynchronous callbacks
+    std::promise<std::string> nested;
+    get_text_async([&nested](bool, std::string) {
+                     std::string value;
+                     get_text(value);
+                     nested.set_value(value);
+                   });
+    EXPECT_EQ("hello async", nested.get_future().get());
+
+    // A cancelled request fails
+    cancel_token token;
+    token.cancel();
+    std::promise<bool> cancelled;
+    get_text_async([&cancelled](bool ok, std::string) {
+                     cancelled.set_value(ok);
+                   }, token);
+    EXPECT_FALSE(cancelled.get_future().get());
+  }
+
+  // Other context (with an empty display it uses the same clipboard
+  // as the free functions)
+  {
+    context ctx;
+    const std::vector<format> formats = ctx.register_formats({ "org.clip.context" });
+    EXPECT_TRUE(formats.size() == 1 && formats[0] != empty_format());
+
+    EXPECT_TRUE(ctx.set_text("context"));
+    size_t count = 0;
+    std::vector<char> data;
+    EXPECT_TRUE(ctx.get_data_if_changed(text_format(), count, data));
+    EXPECT_EQ("context", std::string(data.begin(), data.end()));
+
+    std::promise<std::string> promise;
+    ctx.get_text_async([&promise](bool ok, std::string value) {
+                         promise.set_value(ok ? value: std::string());
+                       });
+    EXPECT_EQ("context", promise.get_future().get());
+
+    std::promise<void> persisted;
+    ctx.persist([&persisted](bool) {
+                  persisted.set_value();
+                });
+    persisted.get_future().get();
+
+    std::string value;
+    EXPECT_TRUE(get_text(value));
+    EXPECT_EQ("context", value);
+
+    // On X11 a context of a display has its own connection, so it
+    // receives the content of the default context from the X server
+    if (get_x11_fd() >= 0 && std::getenv("DISPLAY")) {
+      context display(std::getenv("DISPLAY"));
+      EXPECT_TRUE(display.get_text(value));
+      EXPECT_EQ("context", value);
+
+      std::promise<std::string> received;
+      display.get_text_async([&received](bool ok, std::string text) {
+                               received.set_value(ok ? text: std::string());
+                             });
+      EXPECT_EQ("context", received.get_future().get());
+      EXPECT_EQ(-1, display.dispatch_pending());
+    }
+  }
+
+  // On X11 with XFixes, the content of other owners is received in
+  // the background with the prefetch policy
+  if (get_x11_fd() >= 0 && std::getenv("DISPLAY")) {
+    const watch_id id = watch([](const clipboard_change&) { });
+    if (id) {
+      unwatch(id);
+
+      x11_prefetch_policy policy;
+      policy.formats = { text_format() };
+      set_x11_prefetch_policy(policy);
+
+      const x11_stats before = get_x11_stats();
+      context owner(std::getenv("DISPLAY"));
+      EXPECT_TRUE(owner.set_text("prefetched"));
+
+      const auto end = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+      while (get_x11_stats().prefetches == before.prefetches &&
+             std::chrono::steady_clock::now() < end) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      }
+      EXPECT_TRUE(get_x11_stats().prefetches > before.prefetches);
+
+      std::string value;
+      EXPECT_TRUE(get_text(value));
+      EXPECT_EQ("prefetched", value);
+      EXPECT_TRUE(get_x11_stats().cache_hits > before.cache_hits);
+
+      set_x11_prefetch_policy(x11_prefetch_policy());
+    }
+  }
+
+  // On X11, concurrent reads of the same content of other owner share
+  // one transfer (or its result in the cache)
+  if (get_x11_fd() >= 0 && std::getenv("DISPLAY")) {
+    const std::string big(4*1024*1024, 'c');
+    context owner(std::getenv("DISPLAY"));
+    EXPECT_TRUE(owner.set_text(big));
+
+    // Both threads read the content with the clipboard locked at the
+    // same time, so the data cannot be discarded in the middle.
+    std::mutex mutex;
+    std::condition_variable cv;
+    int arrived = 0;
+    auto barrier = [&mutex, &cv, &arrived](const int n) {
+      std::unique_lock<std::mutex> guard(mutex);
+      ++arrived;
+      cv.notify_all();
+      cv.wait(guard, [&arrived, n]{ return arrived >= n; });
+    };
+    auto read = [&big, &barrier](std::string& value) {
+      lock l(lock_mode::shared);
+      barrier(2);
+      std::vector<char> buf(big.size()+1);
+      if (l.locked() && l.get_data(text_format(), &buf[0], buf.size()))
+        value = &buf[0];
+      barrier(4);
+    };
+
+    const x11_stats before = get_x11_stats();
+    std::string value1, value2;
+    std::thread thread1(read, std::ref(value1));
+    std::thread thread2(read, std::ref(value2));
+    thread1.join();
+    thread2.join();
+    EXPECT_TRUE(big == value1);
+    EXPECT_TRUE(big == value2);
+
+    const x11_stats after = get_x11_stats();
+    EXPECT_TRUE(after.coalesced + after.cache_hits >
+                before.coalesced + before.cache_hits);
+  }
+
+  // Text bigger than the maximum request size (on X11 it's sent and
+  // received in chunks with the INCR method)
+  {
+    std::string big(24*1024*1024, ' ');
+    for (size_t i=0; i<big.size(); ++i)
+      big[i] = 'a' + (i % 26);
+    EXPECT_TRUE(set_text(big));
+
+    std::promise<std::string> promise;
+    get_text_async([&promise](bool ok, std::string value) {
+                     promise.set_value(ok ? value: std::string());
+                   });
+    const std::string value = promise.get_future().get();
+    EXPECT_EQ(big.size(), value.size());
+    EXPECT_TRUE(big == value);
   }
 }
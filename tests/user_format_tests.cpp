@@ -8,6 +8,7 @@
 
 #include "clip.h"
 
+#include <cstdlib>
 #include <cstring>
 #include <string>
 #include <vector>
@@ -21,6 +22,16 @@ int main(int argc, char** argv)
   EXPECT_TRUE(intF != empty_format());
   EXPECT_TRUE(doubleF != empty_format());
 
+  // Registering the same names again returns the same formats
+  {
+    std::vector<format> formats =
+      register_formats({ "com.github.clip.double",
+                         "com.github.clip.int" });
+    EXPECT_EQ(2, formats.size());
+    EXPECT_EQ(doubleF, formats[0]);
+    EXPECT_EQ(intF, formats[1]);
+  }
+
   // Clear clipboard content
   {
     clear();
@@ -75,4 +86,49 @@ int main(int argc, char** argv)
     EXPECT_EQ(32, intV);
     EXPECT_EQ(32.48, doubleV);
   }
+
+  // Get all formats at once
+  {
+    lock l;
+    std::vector<std::vector<char>> data;
+    EXPECT_TRUE(l.get_many({ text_format(), intF, doubleF }, data));
+    EXPECT_EQ(3, data.size());
+    EXPECT_EQ("thirty-two", std::string(data[0].begin(), data[0].end()));
+    EXPECT_EQ(sizeof(int), data[1].size());
+    EXPECT_EQ(sizeof(double), data[2].size());
+    EXPECT_EQ(32, *(const int*)&data[1][0]);
+    EXPECT_EQ(32.48, *(const double*)&data[2][0]);
+  }
+
+  // Get all formats at once from other clipboard owner (on X11 a
+  // context of the display has its own connection, so the formats are
+  // requested with the MULTIPLE target)
+  if (get_x11_fd() >= 0 && std::getenv("DISPLAY")) {
+    context owner(std::getenv("DISPLAY"));
+    const std::vector<format> formats =
+      owner.register_formats({ "com.github.clip.int",
+                               "com.github.clip.double" });
+    {
+      lock l(owner);
+      EXPECT_TRUE(l.locked());
+      int intV = 64;
+      double doubleV = 64.96;
+      EXPECT_TRUE(l.clear());
+      EXPECT_TRUE(l.set_data(text_format(), (const char*)"sixty-four", 10));
+      EXPECT_TRUE(l.set_data(formats[0], (const char*)&intV, sizeof(int)));
+      EXPECT_TRUE(l.set_data(formats[1], (const char*)&doubleV, sizeof(double)));
+    }
+
+    format missingF = register_format("com.github.clip.missing");
+    lock l;
+    std::vector<std::vector<char>> data;
+    EXPECT_FALSE(l.get_many({ text_format(), intF, missingF, doubleF }, data));
+    EXPECT_EQ(4, data.size());
+    EXPECT_EQ("sixty-four", std::string(data[0].begin(), data[0].end()));
+    EXPECT_EQ(sizeof(int), data[1].size());
+    EXPECT_TRUE(data[2].empty());
+    EXPECT_EQ(sizeof(double), data[3].size());
+    EXPECT_EQ(64, *(const int*)&data[1][0]);
+    EXPECT_EQ(64.96, *(const double*)&data[3][0]);
+  }
 }
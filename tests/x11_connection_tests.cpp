@@ -0,0 +1,89 @@
+// Clip Library
+// Copyright (C) 2018-2024 David Capello
+//
+// This file is released under the terms of the MIT license.
+// Read LICENSE.txt for more information.
+
+#include "test.h"
+
+#include "clip.h"
+
+#include <xcb/xcb.h>
+
+#include <poll.h>
+
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+
+using namespace clip;
+
+int main(int argc, char** argv)
+{
+  // The connection and the window of the application
+  xcb_connection_t* connection = xcb_connect(nullptr, nullptr);
+  EXPECT_EQ(0, xcb_connection_has_error(connection));
+
+  xcb_screen_t* screen =
+    xcb_setup_roots_iterator(xcb_get_setup(connection)).data;
+  const xcb_window_t window = xcb_generate_id(connection);
+  const uint32_t app_mask = XCB_EVENT_MASK_KEY_PRESS;
+  xcb_create_window(connection, 0,
+                    window,
+                    screen->root,
+                    0, 0, 1, 1, 0,
+                    XCB_WINDOW_CLASS_INPUT_OUTPUT,
+                    screen->root_visual,
+                    XCB_CW_EVENT_MASK,
+                    &app_mask);
+  xcb_flush(connection);
+
+  EXPECT_TRUE(x11::set_connection(connection, window));
+  EXPECT_TRUE(set_text("external"));
+
+  // The clipboard is already using the connection
+  EXPECT_FALSE(x11::set_connection(connection, window));
+
+  // The events of the application are kept in its window
+  {
+    xcb_get_window_attributes_reply_t* attrs =
+      xcb_get_window_attributes_reply(
+        connection,
+        xcb_get_window_attributes(connection, window),
+        nullptr);
+    EXPECT_TRUE(attrs != nullptr);
+    EXPECT_TRUE((attrs->your_event_mask & app_mask) == app_mask);
+    EXPECT_TRUE((attrs->your_event_mask & XCB_EVENT_MASK_PROPERTY_CHANGE) != 0);
+    free(attrs);
+  }
+
+  // Our own content is received through the X server, and the events
+  // are given to the clipboard by the application
+  {
+    bool called = false;
+    std::string value;
+    get_text_async([&](bool ok, std::string text) {
+                     called = true;
+                     value = (ok ? text: std::string());
+                   });
+
+    const auto end = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while (!called && std::chrono::steady_clock::now() < end) {
+      while (xcb_generic_event_t* event = xcb_poll_for_event(connection)) {
+        x11::handle_event(event);
+        free(event);
+      }
+      const int timeout = dispatch_pending();
+      if (!called) {
+        pollfd pfd;
+        pfd.fd = xcb_get_file_descriptor(connection);
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        poll(&pfd, 1, (timeout < 0 ? 100: timeout));
+      }
+    }
+    EXPECT_TRUE(called);
+    EXPECT_EQ("external", value);
+  }
+}
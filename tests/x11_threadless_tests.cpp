@@ -0,0 +1,66 @@
+// Clip Library
+// Copyright (C) 2018-2024 David Capello
+//
+// This file is released under the terms of the MIT license.
+// Read LICENSE.txt for more information.
+
+#include "test.h"
+
+#include "clip.h"
+
+#include <poll.h>
+
+#include <chrono>
+#include <string>
+#include <thread>
+
+using namespace clip;
+
+int main(int argc, char** argv)
+{
+  // The threadless mode must be enabled before the clipboard is used
+  // for the first time.
+  set_x11_threadless(true);
+  EXPECT_TRUE(get_x11_threadless());
+
+  const int fd = get_x11_fd();
+  EXPECT_TRUE(fd >= 0);
+
+  // The synchronous functions process the events themselves
+  {
+    EXPECT_TRUE(set_text("threadless"));
+    std::string value;
+    EXPECT_TRUE(get_text(value));
+    EXPECT_EQ("threadless", value);
+  }
+
+  // The asynchronous callbacks are called from dispatch_pending() in
+  // this same thread (our own content is received through the X
+  // server, so we answer the request in dispatch_pending() too)
+  {
+    const std::thread::id main_thread = std::this_thread::get_id();
+    bool called = false;
+    bool same_thread = false;
+    std::string value;
+    get_text_async([&](bool ok, std::string text) {
+                     called = true;
+                     same_thread = (std::this_thread::get_id() == main_thread);
+                     value = (ok ? text: std::string());
+                   });
+
+    const auto end = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while (!called && std::chrono::steady_clock::now() < end) {
+      const int timeout = dispatch_pending();
+      if (!called) {
+        pollfd pfd;
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        poll(&pfd, 1, (timeout < 0 ? 100: timeout));
+      }
+    }
+    EXPECT_TRUE(called);
+    EXPECT_TRUE(same_thread);
+    EXPECT_EQ("threadless", value);
+  }
+}